@@ -29,6 +29,10 @@ namespace G13 {
         }
 
     protected:
+        [[nodiscard]] PARENT_T& parent() const {
+            return *_parent_ptr;
+        }
+
         std::string _name{};
         std::shared_ptr<Action> _action{};
 
@@ -0,0 +1,81 @@
+//
+// Created by Britt Yazel on 03-16-2025.
+//
+
+#ifndef CONFIG_SNAPSHOT_HPP
+#define CONFIG_SNAPSHOT_HPP
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace G13 {
+    class Device; // Forward declaration
+
+    constexpr char SNAPSHOT_MAGIC[] = {'G', '1', '3', 'S'};
+    constexpr uint32_t SNAPSHOT_VERSION = 1;
+
+    /*!
+     * Compiled configuration (g13d --compile)
+     *
+     * A bind file and everything it loads, flattened into one binary file: a header, then one record per
+     * command holding the command's index in the command table and its arguments. Comments, blank lines,
+     * unknown commands and "load" are all dealt with when compiling, so applying a snapshot only has to
+     * mmap it and call each command directly. Snapshots use the byte order of the machine which compiled
+     * them, and are refused once the daemon's command table changes.
+     *
+     * The daemon also compiles a plain --config bind file into the same format in memory, once, and
+     * replays that program on every device it sets up.
+     */
+    class ConfigSnapshot {
+    public:
+        ConfigSnapshot();
+        ~ConfigSnapshot();
+
+        ConfigSnapshot(const ConfigSnapshot&) = delete;
+        ConfigSnapshot& operator=(const ConfigSnapshot&) = delete;
+
+        static bool Compile(const std::string& config_filename, const std::string& snapshot_filename);
+        static bool IsSnapshot(const std::string& filename);
+
+        bool Load(const std::string& filename);
+        bool Open(const std::string& filename);
+        void Close();
+        [[nodiscard]] bool empty() const;
+        [[nodiscard]] const std::vector<std::string>& getSources() const;
+        size_t Apply(Device& g13) const;
+        void ForEachCommand(const std::function<void(size_t command, std::string_view remainder)>& callback) const;
+
+        static std::vector<std::string> Diff(const ConfigSnapshot& from, const ConfigSnapshot& to);
+
+    private:
+        struct Header {
+            char magic[sizeof(SNAPSHOT_MAGIC)];
+            uint32_t version;
+            uint32_t command_table_hash;
+            uint32_t record_count;
+        };
+
+        struct Record {
+            uint8_t command;
+            uint8_t reserved;
+            uint16_t length;
+        };
+
+        static bool CompileToBuffer(const std::string& filename, bool strict, std::string& output,
+                                    std::vector<std::string>& sources);
+        static bool CompileFile(const std::string& filename, bool strict, std::vector<std::string>& files_loading,
+                                std::vector<std::string>& sources, std::string& records, uint32_t& record_count);
+
+        const char* data;
+        size_t size;
+        // Holds the program when it was compiled in memory rather than mapped from a snapshot file
+        std::string compiled;
+        // Every file the program was built from
+        std::vector<std::string> sources;
+    };
+}
+
+#endif
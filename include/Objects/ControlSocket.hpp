@@ -0,0 +1,82 @@
+//
+// Created by Britt Yazel on 03-16-2025.
+//
+
+#ifndef CONTROL_SOCKET_HPP
+#define CONTROL_SOCKET_HPP
+
+#include <map>
+#include <memory>
+#include <string>
+#include <sys/types.h>
+
+#include "Utils/InputBuffer.hpp"
+
+namespace G13 {
+    class ControlSocket; // Forward declaration
+    class Device; // Forward declaration
+
+    // A client with more replies than this queued is not reading them and gets disconnected
+    constexpr size_t CONTROL_CLIENT_MAX_BUFFER = 1024 * 1024;
+
+    /*!
+     * One connection to a device's control socket, with its own input and output buffers
+     */
+    class ControlClient {
+    public:
+        explicit ControlClient(int fid);
+        ~ControlClient();
+
+        ControlClient(const ControlClient&) = delete;
+        ControlClient& operator=(const ControlClient&) = delete;
+
+        // Queues "[@id ]OK" or "[@id ]ERR <error>" for the command that just ran
+        void Reply(const std::string& id, const char* error);
+
+    private:
+        friend class ControlSocket;
+
+        bool Flush();
+
+        int fid;
+        InputBuffer input;
+        std::string output;
+        bool closing;
+    };
+
+    /*!
+     * Per device control socket
+     *
+     * A stream socket next to the pipes (g13-N.sock) which any number of clients can connect to at once.
+     * Each client speaks the same protocol as the input pipe, text lines and framed messages, but its
+     * stream is parsed on its own, so writers never interleave, and every command gets one reply line
+     * back in order. A text command starting with "@<id> " has the id echoed on its reply.
+     */
+    class ControlSocket {
+    public:
+        explicit ControlSocket(Device& device);
+        ~ControlSocket();
+
+        ControlSocket(const ControlSocket&) = delete;
+        ControlSocket& operator=(const ControlSocket&) = delete;
+
+        bool Open(const std::string& path, mode_t umask);
+        void Close();
+        [[nodiscard]] size_t getClientCount() const;
+
+    private:
+        friend class ControlClient;
+
+        void Accept();
+        void ReadClient(int client_fid);
+        void DropClient(int client_fid);
+        void UpdateInterest(const ControlClient& client) const;
+
+        Device& device;
+        int listen_fid;
+        std::string path;
+        std::map<int, std::unique_ptr<ControlClient>> clients;
+    };
+}
+
+#endif
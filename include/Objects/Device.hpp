@@ -6,13 +6,20 @@
 #define DEVICE_HPP
 
 
+#include <atomic>
 #include <libusb-1.0/libusb.h>
 #include <linux/uinput.h>
 #include <map>
+#include <mutex>
 #include <regex>
+#include <string_view>
+#include <thread>
 #include <vector>
 
+#include "ControlSocket.hpp"
+#include "EventLoop.hpp"
 #include "Font.hpp"
+#include "Utils/InputBuffer.hpp"
 #include "Screen.hpp"
 #include "Profile.hpp"
 #include "Stick.hpp"
@@ -20,17 +27,39 @@
 
 namespace G13 {
     class Action; // Forward declaration
+    class Key; // Forward declaration
 
     constexpr size_t NUM_KEYS = 40;
+    constexpr size_t INPUT_TRANSFER_COUNT = 4;
+    // Consecutive failures after which a key transfer is no longer resubmitted
+    constexpr int MAX_INPUT_TRANSFER_FAILURES = 8;
+    constexpr size_t REPORT_QUEUE_SIZE = 64;
+    constexpr size_t EVENT_BATCH_SIZE = 64;
+    // Power of two with room to spare, so a collision free seed for the command name hash is quick to find
+    constexpr size_t COMMAND_HASH_SLOTS = 64;
+
+    // Framed messages on the input pipe: FRAME_MAGIC, a frame_type_t, one reserved byte,
+    // the payload length as 32-bit little endian, then the payload
+    constexpr char FRAME_MAGIC[] = {'\0', 'G'};
+    constexpr size_t FRAME_HEADER_SIZE = 8;
+    constexpr size_t FRAME_MAX_PAYLOAD = 64 * 1024;
+    // Receive buffer of the input pipe and of each control socket client; has to hold the largest frame
+    constexpr size_t COMMAND_BUFFER_SIZE = 128 * 1024;
+    static_assert(COMMAND_BUFFER_SIZE >= FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD);
+
+    enum frame_type_t : unsigned char {
+        FRAME_TEXT = 'T',
+        FRAME_IMAGE = 'F',
+        FRAME_BLIT = 'B'
+    };
 
     inline void IGUR(...) {}
 
     class Device {
     public:
-        typedef std::function<void(const char*)> COMMAND_FUNCTION;
-        typedef std::map<std::string, COMMAND_FUNCTION> CommandFunctionTable;
+        typedef void (Device::*COMMAND_FUNCTION)(std::string_view remainder);
 
-        bool connected;
+        std::atomic<bool> connected;
 
         Device(libusb_device* usb_device, libusb_context* usb_context, libusb_device_handle* usb_handle,
                    int device_index);
@@ -38,6 +67,10 @@ namespace G13 {
 
         void Cleanup();
         void RegisterContext(libusb_context* new_usb_context);
+        void StartThread();
+        void StopThread();
+        void Post(std::function<void()> work);
+        void ApplyConfigChanges(const std::vector<std::string>& commands);
 
         Screen& getScreenRef();
         Stick& getStickRef();
@@ -48,19 +81,40 @@ namespace G13 {
         [[nodiscard]] std::vector<std::string> FilteredProfileNames(const std::regex& pattern) const;
 
         void Dump(std::ostream& o, int detail = 0);
-        void Command(const char* str, const char* info = nullptr);
+        void Command(std::string_view str, const char* info = nullptr);
+        void Execute(std::string_view str, const char* info = nullptr);
+        void RunCommand(size_t index, std::string_view remainder);
+        static int FindCommandIndex(std::string_view name);
+        static std::string_view CommandName(size_t index);
+        static uint32_t CommandTableHash();
         void ReadCommandsFromPipe();
-        int ReadDeviceInputs();
+        size_t ProcessBuffer(char* buffer, size_t size, ControlClient* client = nullptr);
+        int StartInputTransfers();
+        void CancelInputTransfers();
+        [[nodiscard]] bool HasPendingTransfers();
+        void ProcessReport(const unsigned char* report);
         void ReadCommandsFromFile(const std::string& filename, const char* info = nullptr);
         static int G13CreateUinput();
+        static int G13CreatePointerUinput();
         static int G13CreateFifo(const char* fifo_name, mode_t umask);
 
         std::shared_ptr<Action> MakeAction(const std::string& action);
+        void SetKeyAction(const Key& key, const std::shared_ptr<Action>& action);
+        void PressBinding(int index, const std::shared_ptr<Action>& action);
+        void ReleaseBinding(int index);
+        [[nodiscard]] uint64_t HeldBindings() const;
+        void PublishBindings();
+        void LoadCalibration();
+        void SaveCalibration() const;
         void SetKeyColor(int red, int green, int blue) const;
         void SetModeLeds(int leds) const;
         void SendEvent(int type, int code, int val);
+        void PressKey(int key);
+        void ReleaseKey(int key);
+        void FlushEvents();
+        void SendPointerEvents(const input_event* events, size_t count) const;
         void OutputPipeWrite(const std::string& out) const;
-        bool updateKeyState(int key, bool state);
+        uint64_t UpdateKeyStates(uint64_t states);
         static std::string DescribeLibusbErrorCode(int code);
 
         [[nodiscard]] int getDeviceIndex() const;
@@ -68,30 +122,75 @@ namespace G13 {
         [[nodiscard]] libusb_device* getDevicePtr() const;
         [[nodiscard]] Font& getCurrentFontRef() const;
         [[nodiscard]] Profile& getCurrentProfileRef() const;
+        [[nodiscard]] EventLoop& getEventLoopRef() const;
         static Device* GetG13DeviceHandle(const libusb_device* dev);
 
     protected:
         void InitFonts();
         void InitScreen();
-        void InitCommands();
 
     private:
-        static bool IsDataAvailable(int fd);
-        void ProcessBuffer(char* buffer, int buffer_end, int read_result);
+        struct CommandEntry {
+            std::string_view name;
+            COMMAND_FUNCTION function;
+        };
+        struct CommandTable;
+
+        void CommandOut(std::string_view remainder);
+        void CommandPos(std::string_view remainder);
+        void CommandBind(std::string_view remainder);
+        void CommandProfile(std::string_view remainder);
+        void CommandFont(std::string_view remainder);
+        void CommandMod(std::string_view remainder);
+        void CommandTextMode(std::string_view remainder);
+        void CommandRgb(std::string_view remainder);
+        void CommandStickMode(std::string_view remainder);
+        void CommandStickZone(std::string_view remainder);
+        void CommandDump(std::string_view remainder);
+        void CommandLogLevel(std::string_view remainder);
+        void CommandRefresh(std::string_view remainder);
+        void CommandPresent(std::string_view remainder);
+        void CommandClear(std::string_view remainder);
+        void CommandDelete(std::string_view remainder);
+        void CommandLoad(std::string_view remainder);
+
+        static void LIBUSB_CALL InputTransferCallback(libusb_transfer* transfer);
+        [[nodiscard]] size_t InputTransferIndex(const libusb_transfer* transfer) const;
+        bool InputTransferFailed(libusb_transfer* transfer);
+        void QueueReport(const unsigned char* report);
+        void DrainReports();
+        void ReclaimBindings();
+        void HandleCommand(std::string_view line, ControlClient* client);
+        size_t ProcessFrame(const char* buffer, size_t size, ControlClient* client);
+        static size_t ResyncFrames(const char* buffer, size_t size);
         [[nodiscard]] std::string NormalizeFilePath(const std::string& filename) const;
+        static int G13OpenUinput();
+        static int G13RegisterUinput(int ufile, const char* name);
         void MakePipeNames();
+        void MakeCalibrationName();
+        void ClosePipes();
+        void CreateFramebuffer();
+        void CloseFramebuffer();
 
-        CommandFunctionTable command_table;
-        input_event device_event{};
+        // Events queued by SendEvent() until the next FlushEvents()
+        input_event event_batch[EVENT_BATCH_SIZE]{};
+        size_t event_batch_count;
 
         int device_index;
         libusb_context* usb_context;
         int uinput_fid;
-        int input_pipe_fid{};
+        // Relative pointer and wheel events of the MOUSE and SCROLL stick modes
+        int pointer_fid;
+        int input_pipe_fid;
         std::string input_pipe_name;
-        std::string input_pipe_fifo;
-        int output_pipe_fid{};
+        InputBuffer input_pipe_buffer;
+        int output_pipe_fid;
         std::string output_pipe_name;
+        int framebuffer_fid;
+        std::string framebuffer_name;
+        unsigned char* framebuffer;
+        std::string control_socket_name;
+        std::string calibration_name;
 
         std::map<std::string, std::shared_ptr<Font>> fonts;
         std::shared_ptr<Font> current_font;
@@ -99,12 +198,46 @@ namespace G13 {
         std::shared_ptr<Profile> current_profile;
         std::vector<std::string> files_currently_loading;
 
+        // The bindings input reports are matched against: the current profile's as of the last
+        // PublishBindings(). ProcessReport() reads active_bindings without locking and keeps input_epoch odd
+        // while it works, replaced bindings wait in retired_bindings until no report can still be using them
+        std::atomic<const KeyBindings*> active_bindings;
+        std::atomic<uint64_t> input_epoch;
+        std::mutex bindings_mutex;
+        std::shared_ptr<const KeyBindings> published_bindings;
+        std::vector<std::pair<uint64_t, std::shared_ptr<const KeyBindings>>> retired_bindings;
+        // While non-zero, binding changes pile up and are published together afterwards
+        int bindings_held;
+
         Screen screen;
         Stick stick;
-        bool keys[NUM_KEYS]{};
+        uint64_t key_states;
+        // The action each held G13 key was pressed with, one bit per key in held_bindings
+        std::shared_ptr<Action> held_actions[NUM_KEYS]{};
+        uint64_t held_bindings;
+        // How many active bindings hold each linux key down, so overlapping bindings share modifiers
+        uint8_t key_press_counts[KEY_CNT]{};
 
         libusb_device_handle* usb_handle;
         libusb_device* usb_device;
+        libusb_transfer* input_transfers[INPUT_TRANSFER_COUNT]{};
+        int input_transfer_failures[INPUT_TRANSFER_COUNT]{};
+        int pending_transfers;
+        bool closing;
+
+        // Only used with --threaded: reports are handed from the USB callbacks to device_thread,
+        // which runs device_loop and owns everything else in this object
+        std::unique_ptr<EventLoop> device_loop;
+        std::thread device_thread;
+        std::atomic<bool> thread_running;
+        int wake_fid;
+        std::mutex report_mutex;
+        std::vector<unsigned char> report_queue;
+        size_t report_head;
+        size_t report_count;
+
+        // Declared after device_loop, which it is registered on
+        ControlSocket control_socket;
     };
 }
 
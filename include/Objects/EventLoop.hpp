@@ -0,0 +1,53 @@
+//
+// Created by Britt Yazel on 03-16-2025.
+//
+
+#ifndef EVENT_LOOP_HPP
+#define EVENT_LOOP_HPP
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace G13 {
+    /*!
+     * Single epoll reactor
+     *
+     * Every file descriptor the daemon cares about (libusb, pipes, sd-bus, signals)
+     * is registered here together with the callback that services it, so the
+     * daemon sleeps until one of them actually becomes ready.
+     * Watch(), Unwatch() and Post() may be called from any thread.
+     */
+    class EventLoop {
+    public:
+        typedef std::function<void(uint32_t events)> FD_CALLBACK;
+        typedef std::function<void()> POSTED_CALLBACK;
+
+        EventLoop();
+        ~EventLoop();
+
+        EventLoop(const EventLoop&) = delete;
+        EventLoop& operator=(const EventLoop&) = delete;
+
+        bool Watch(int fd, uint32_t events, FD_CALLBACK callback);
+        bool Modify(int fd, uint32_t events);
+        void Unwatch(int fd);
+        void Post(POSTED_CALLBACK callback);
+        int RunOnce(int timeout_ms = -1);
+
+    private:
+        void RunPosted();
+
+        int epoll_fid;
+        int post_fid;
+        std::mutex posted_mutex;
+        std::vector<POSTED_CALLBACK> posted;
+        std::mutex callbacks_mutex;
+        std::map<int, std::shared_ptr<FD_CALLBACK>> callbacks;
+    };
+}
+
+#endif
@@ -5,6 +5,7 @@
 #ifndef ACTION_KEYS_HPP
 #define ACTION_KEYS_HPP
 
+#include <linux/input.h>
 #include <vector>
 
 #include "Objects/Action.hpp"
@@ -24,6 +25,13 @@ namespace G13 {
 
         std::vector<KeyState> _keys;
         std::vector<KeyState> _keys_up;
+
+    protected:
+        void compile();
+
+        // Precompiled at bind time: value 1 presses a key, value 0 releases it
+        std::vector<input_event> _down_events;
+        std::vector<input_event> _up_events;
     };
 }
 
@@ -7,15 +7,42 @@
 #ifndef PROFILE_HPP
 #define PROFILE_HPP
 
+#include <cstdint>
+#include <memory>
 #include <regex>
+#include <string>
+#include <vector>
 
 namespace G13 {
+    class Action;
+    class Device;
     class Key;
+
+    /// One layer of a profile's bindings: the keys bound differently than in base, one action for each bit set
+    /// in mask, in key order. A null action unbinds a key which base binds. Never changed once shared
+    struct KeyBindings {
+        uint64_t mask = 0;
+        std::vector<std::shared_ptr<Action>> actions;
+        // Every key bound once this layer is put on top of base
+        uint64_t bound = 0;
+        std::shared_ptr<const KeyBindings> base;
+
+        [[nodiscard]] size_t slot(int index) const;
+        [[nodiscard]] const std::shared_ptr<Action>& action(int index) const;
+        void assign(int index, const std::shared_ptr<Action>& action);
+    };
+
     /*!
      * Represents a set of configured key mappings
      *
      * This allows a keypad to have multiple configured
      * profiles and switch between them easily
+     *
+     * The keys themselves live in one table shared by every profile; a profile only holds the actions
+     * bound to it. A profile made from another one shares that profile's bindings, and on its first change
+     * stacks a layer of its own on top of them which holds only the keys it binds differently. Creating
+     * and switching profiles therefore costs the same however many keys are bound, and each profile only
+     * grows with its own changes.
      */
     class Profile {
     public:
@@ -23,18 +50,28 @@ namespace G13 {
         Profile(const Profile& other, std::string name_arg);
 
         // search key by G13 keyname
-        Key* FindKey(const std::string& keyname);
+        [[nodiscard]] const Key* FindKey(const std::string& keyname) const;
+        [[nodiscard]] const std::shared_ptr<Action>& action(int index) const;
+        void SetKeyAction(int index, const std::shared_ptr<Action>& action);
+        [[nodiscard]] std::shared_ptr<const KeyBindings> bindings() const;
         [[nodiscard]] std::vector<std::string> FilteredKeyNames(const std::regex& pattern, bool all = false) const;
         void dump(std::ostream& o) const;
-        void ParseKeys(const unsigned char* buf);
+        static void ParseKeys(Device& keypad, const KeyBindings& bindings, const unsigned char* buf);
         [[nodiscard]] const std::string& name() const;
 
     protected:
+        struct KeyTable {
+            std::vector<Key> keys;
+            uint64_t parse_mask = 0;
+        };
+
+        static const KeyTable& _key_table();
+
         Device& _keypad;
-        std::vector<Key> _keys;
+        std::shared_ptr<KeyBindings> _bindings;
+        // Whether _bindings is this profile's own layer, rather than the one of the profile it was made from
+        bool _owns_layer;
         std::string _name;
-
-        void _init_keys();
     };
 }
 
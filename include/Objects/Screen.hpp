@@ -5,7 +5,10 @@
 #ifndef Screen_HPP
 #define Screen_HPP
 
+#include <libusb-1.0/libusb.h>
+#include <mutex>
 #include <string>
+#include <string_view>
 
 namespace G13 {
     class Device;
@@ -17,35 +20,72 @@ namespace G13 {
     constexpr size_t SCREEN_BUF_SIZE = SCREEN_ROWS * SCREEN_BYTES_PER_ROW;
     constexpr size_t SCREEN_TEXT_CHAR_HEIGHT = 8;
     constexpr size_t SCREEN_TEXT_ROWS = 160 / SCREEN_TEXT_CHAR_HEIGHT;
+    constexpr int DEFAULT_LCD_FPS = 30;
 
     class Screen {
     public:
         explicit Screen(Device& keypad);
+        ~Screen();
 
         // Image handling
-        void Image(const unsigned char* data, int size) const;
-        void image_send() const;
+        void Image(const unsigned char* data, int size);
+        void image_send();
+        void Present(const unsigned char* frame);
         void image_clear();
+        void Blit(unsigned col, unsigned page, unsigned width, unsigned pages, const unsigned char* data);
         static unsigned image_byte_offset(unsigned row, unsigned col);
 
         // Text handling
         void WriteChar(char c, unsigned int row = -1, unsigned int col = -1);
-        void WriteString(const char* str);
+        void WriteString(std::string_view str);
         void WritePos(int row, int col);
 
         // File handling
-        void ScreenWrite(const unsigned char* data, size_t size) const;
-        void ScreenWriteFile(const std::string& filename) const;
+        void ScreenWrite(const unsigned char* data, size_t size);
+        void ScreenWriteFile(const std::string& filename);
+        void InvalidateFrame();
+        void CancelTransfer();
+        void StopCompositor();
+        [[nodiscard]] bool HasPendingTransfer();
 
         // Setters
         void setTextMode(int new_text_mode);
 
+        // Getters
+        [[nodiscard]] unsigned long getSkippedFrames() const;
+
     private:
+        void ArmCompositor();
+        void Composite();
+        void SubmitFrame(const unsigned char* data);
+        static void LIBUSB_CALL FrameTransferCallback(libusb_transfer* transfer);
+
         Device& m_keypad;
+        // Back buffer every draw command works on; the compositor flips it to the device
         unsigned char image_buf[SCREEN_BUF_SIZE + 8]{};
         unsigned cursor_row;
         unsigned cursor_col;
         int text_mode;
+
+        // Copy of the newest frame handed to the device, so identical frames are not sent again
+        std::mutex frame_mutex;
+        unsigned char last_frame[SCREEN_BUFFER_SIZE]{};
+        bool last_frame_valid;
+        unsigned long skipped_frames;
+
+        // At most one asynchronous LCD transfer is in flight; newer frames wait in the pending slot
+        libusb_transfer* lcd_transfer;
+        bool transfer_in_flight;
+        bool transfer_cancelled;
+        bool frame_pending;
+        unsigned char pending_frame[SCREEN_BUFFER_SIZE]{};
+
+        // Frame-rate-capped compositor timer
+        const unsigned char* external_frame;
+        bool back_buffer_dirty;
+        int compositor_fid;
+        bool compositor_armed;
+        long frame_interval_ns;
     };
 }
 
@@ -5,6 +5,9 @@
 #ifndef STICK_HPP
 #define STICK_HPP
 
+#include <array>
+#include <cstdint>
+#include <memory>
 #include <vector>
 #include <regex>
 
@@ -12,6 +15,7 @@
 
 namespace G13 {
 
+    class Action;
     class StickZone; // Forward declaration
 
     typedef Coord<int> StickCoord;
@@ -19,6 +23,26 @@ namespace G13 {
     typedef Coord<double> ZoneCoord;
     typedef Bounds<double> ZoneBounds;
 
+    // One bit per zone in the zone masks
+    constexpr size_t MAX_STICK_ZONES = 64;
+    // One entry for every raw (x, y) the stick can report
+    constexpr size_t STICK_ZONE_TABLE_SIZE = 256 * 256;
+    // Weight of a new position in the smoothed one, out of this, when smoothing is off
+    constexpr int STICK_SMOOTHING_ONE = 256;
+    // Steps per second the smoothed position keeps taking towards a stick which stopped reporting
+    constexpr int STICK_SMOOTHING_RATE = 100;
+    // After this many steps without catching up, the smoothed position is snapped to the stick's
+    constexpr int STICK_SMOOTHING_MAX_TICKS = STICK_SMOOTHING_RATE;
+    // Calibrated deflection runs from -STICK_FIXED_ONE (top/left) to STICK_FIXED_ONE (bottom/right)
+    constexpr int STICK_FIXED_SHIFT = 16;
+    constexpr int STICK_FIXED_ONE = 1 << STICK_FIXED_SHIFT;
+    // Fixed point precision of the north rotation
+    constexpr int STICK_ROTATION_SHIFT = 14;
+    // Pointer and wheel updates per second in MOUSE and SCROLL mode, whatever rate the G13 sends reports at
+    constexpr long STICK_MOTION_RATE = 125;
+    // Units of REL_WHEEL_HI_RES and REL_HWHEEL_HI_RES per wheel detent
+    constexpr int WHEEL_HI_RES_DETENT = 120;
+
     // *************************************************************************
 
     enum stick_mode_t {
@@ -26,24 +50,73 @@ namespace G13 {
         STICK_KEYS,
         STICK_CALIB_CENTER,
         STICK_CALIB_BOUNDS,
-        STICK_CALIB_NORTH
+        STICK_CALIB_NORTH,
+        STICK_MOUSE,
+        STICK_SCROLL
+    };
+
+    /// How the MOUSE and SCROLL modes turn deflection into speed
+    struct StickMotion {
+        // Part of the stick's travel around the center which is ignored, 0 to below 1
+        double deadzone;
+        // Pixels (MOUSE) or wheel detents (SCROLL) per second with the stick pushed all the way
+        double speed;
+        // Exponent of the acceleration, 1 is linear
+        double curve;
     };
 
+    constexpr StickMotion DEFAULT_MOUSE_MOTION = {0.1, 1000, 2};
+    constexpr StickMotion DEFAULT_SCROLL_MOTION = {0.15, 15, 2};
+
     class Stick {
     public:
         explicit Stick(Device& keypad);
+        ~Stick();
 
         void ParseJoystick(const unsigned char* buf);
 
         void set_mode(stick_mode_t);
+        void set_smoothing(double factor);
+        void StopSmoothing();
+        void set_motion(stick_mode_t mode, const StickMotion& motion);
+        void StopMotion();
+        bool LoadCalibration(const std::string& filename);
+        [[nodiscard]] bool SaveCalibration(const std::string& filename) const;
         StickZone* zone(const std::string&, bool create = false);
         [[nodiscard]] std::vector<std::string> FilteredZoneNames(const std::regex& pattern) const;
         void RemoveZone(const StickZone& zone);
+        void SetZoneAction(StickZone& zone, const std::shared_ptr<Action>& action);
+        void InvalidateZones();
 
         void dump(std::ostream&) const;
 
     protected:
-        static void RecalcCalibrated();
+        // Zones a position enters, and zones it stays in if it was in them already
+        struct ZoneMasks {
+            uint64_t enter;
+            uint64_t stay;
+
+            bool operator==(const ZoneMasks&) const = default;
+        };
+
+        static bool CalibrationValid(const StickBounds& bounds, const StickCoord& center, const StickCoord& north);
+        void RecalcCalibrated();
+        [[nodiscard]] StickCoord Deflection(const StickCoord& pos) const;
+        [[nodiscard]] StickCoord Rotate(const StickCoord& vector) const;
+        [[nodiscard]] ZoneCoord Normalize(const StickCoord& pos) const;
+        [[nodiscard]] ZoneMasks ZoneMask(const StickCoord& pos) const;
+        StickCoord Smooth(const StickCoord& raw);
+        void ArmSmoothing();
+        void DisarmSmoothing();
+        void SmoothingTick();
+        void BuildMotionTable();
+        void ArmMotion();
+        void DisarmMotion();
+        void MotionTick();
+        void SendWheel(int horizontal, int vertical);
+        void BuildZoneTable();
+        void UpdateZones(const StickCoord& pos);
+        void ReleaseZones();
 
         Device& _keypad;
         std::vector<StickZone> m_zones;
@@ -51,10 +124,53 @@ namespace G13 {
         StickBounds m_bounds;
         StickCoord m_center_pos;
         StickCoord m_north_pos;
+        // The last calibration which passed CalibrationValid(), restored when a new one doesn't
+        StickBounds m_saved_bounds;
+        StickCoord m_saved_center_pos;
+        StickCoord m_saved_north_pos;
 
         StickCoord m_current_pos;
+        StickCoord m_sent_pos;
+
+        // Worked out by RecalcCalibrated(): fixed point deflection per raw unit below and above the center
+        // of each axis, and the rotation which turns the calibrated north straight up
+        StickCoord m_scale_low;
+        StickCoord m_scale_high;
+        int m_north_cos;
+        int m_north_sin;
 
         stick_mode_t m_stick_mode;
+
+        // Raw (y << 8 | x) to an index into m_zone_masks, which holds every distinct set of zones the stick
+        // can be in. Empty when there are too many of those for a byte, then masks are worked out per report
+        std::vector<uint8_t> m_zone_table;
+        std::vector<ZoneMasks> m_zone_masks;
+        bool m_zone_table_valid;
+        // Bit n set while the stick is inside m_zones[n]
+        uint64_t m_active_zones;
+
+        // Exponential moving average of the position zones are tested against, in 8.8 fixed point
+        int m_smoothing_weight;
+        StickCoord m_smoothed_pos;
+        bool m_smoothed_valid;
+        // Keeps smoothing between reports, since the G13 only reports while the stick moves
+        int m_smoothing_fid;
+        bool m_smoothing_armed;
+        int m_smoothing_ticks;
+
+        // MOUSE and SCROLL mode: speed for every raw x and y, in 1/256 pixels or hi-res wheel units per tick,
+        // from the calibration and the mode's StickMotion. A timer moves while the stick is deflected
+        std::array<int, 256> m_motion_speed_x{};
+        std::array<int, 256> m_motion_speed_y{};
+        bool m_motion_table_valid;
+        StickMotion m_mouse_motion;
+        StickMotion m_scroll_motion;
+        int m_motion_fid;
+        bool m_motion_armed;
+        // Fractions of a unit carried over to the next tick
+        StickCoord m_motion_remainder;
+        // Hi-res wheel units not yet sent as classic detents
+        StickCoord m_wheel_remainder;
     };
 }
 
@@ -17,8 +17,11 @@ namespace G13 {
                       const std::shared_ptr<Action>& = nullptr);
 
         void dump(std::ostream&) const;
-        void test(const ZoneCoord& loc);
+        [[nodiscard]] const ZoneBounds& bounds() const;
+        [[nodiscard]] ZoneBounds enter_bounds() const;
+        [[nodiscard]] ZoneBounds exit_bounds() const;
         void set_bounds(const ZoneBounds& bounds);
+        void set_hysteresis(double enter_margin, double exit_margin);
 
         //Operator Overload
         bool operator==(const StickZone& other) const {
@@ -27,7 +30,9 @@ namespace G13 {
 
     protected:
         ZoneBounds _bounds;
-        bool _active;
+        // The stick has to get this far inside the bounds to enter the zone, and this far outside to leave it
+        double _enter_margin;
+        double _exit_margin;
     };
 }
 
@@ -0,0 +1,41 @@
+//
+// Created by Britt Yazel on 03-16-2025.
+//
+
+#ifndef INPUT_BUFFER_HPP
+#define INPUT_BUFFER_HPP
+
+#include <memory>
+#include <sys/types.h>
+
+namespace G13 {
+    /*!
+     * Fixed size receive buffer for a command stream
+     *
+     * read() goes straight into the free space at the end, and consumed bytes are dropped by moving
+     * the head forward. Only when the tail reaches the end of the storage is the unconsumed remainder,
+     * at most one partial message, moved back to the front. Messages therefore always stay contiguous
+     * and a burst of commands costs no allocations or copies.
+     */
+    class InputBuffer {
+    public:
+        explicit InputBuffer(size_t capacity);
+
+        ssize_t Read(int fd);
+        void Consume(size_t count);
+        void Clear();
+
+        [[nodiscard]] char* data() const;
+        [[nodiscard]] size_t size() const;
+        [[nodiscard]] bool empty() const;
+        [[nodiscard]] bool full() const;
+
+    private:
+        std::unique_ptr<char[]> storage;
+        size_t capacity;
+        size_t head;
+        size_t tail;
+    };
+}
+
+#endif
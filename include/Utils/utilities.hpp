@@ -5,14 +5,16 @@
 #ifndef UTILITIES_HPP
 #define UTILITIES_HPP
 
+#include <string_view>
+
 #include "StringFormatter.hpp"
 
 namespace G13 {
     enum class Empties { empties_ok, no_empties };
 
     StringFormatter formatter(const std::string& new_string);
-    const char* left_trim(const char* string);
-    std::string extract_and_advance_token(const char*& source);
+    std::string_view left_trim(std::string_view string);
+    std::string_view extract_and_advance_token(std::string_view& source);
     std::string glob_to_regex(const char* glob);
 }
 
@@ -5,7 +5,9 @@
 #ifndef UTILITIES_TPP
 #define UTILITIES_TPP
 
+#include <charconv>
 #include <map>
+#include <string_view>
 
 #include "exceptions.hpp"
 
@@ -19,6 +21,9 @@ namespace G13 {
     template <class T_KEY, class T_VAL>
     T_VAL& find_or_throw(std::map<T_KEY, T_VAL>& m, const T_KEY& target);
 
+    template <class T>
+    T extract_and_advance_number(std::string_view& source);
+
     template <class T>
     class Coord {
     public:
@@ -89,6 +94,18 @@ namespace G13 {
         return i->second;
     }
 
+    // Parses the next token of source as a number, throwing a CommandException if it is missing or not a number
+    template <class T>
+    T extract_and_advance_number(std::string_view& source) {
+        const std::string_view token = extract_and_advance_token(source);
+        T value{};
+        const auto [end, error] = std::from_chars(token.data(), token.data() + token.size(), value);
+        if (token.empty() || error != std::errc() || end != token.data() + token.size()) {
+            throw CommandException("bad number: <" + std::string(token) + ">");
+        }
+        return value;
+    }
+
     template <class T>
     Coord<T>::Coord() : x(), y() {}
 
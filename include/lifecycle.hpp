@@ -5,20 +5,30 @@
 #ifndef LIFECYCLE_HPP
 #define LIFECYCLE_HPP
 
+#include <atomic>
 #include <libusb-1.0/libusb.h>
 
 #include "Objects/Device.hpp"
 
 namespace G13 {
-    extern bool suspended;
+    extern std::atomic<bool> suspended;
 
     void DiscoverG13s(libusb_device** devs, ssize_t count);
     int OpenAndAddG13(libusb_device* dev);
+    void LoadConfig();
+    void SetupNewDevices();
     void SetupDevice(Device* g13);
     void CleanupDevices(const libusb_device* dev = nullptr);
+    void ReapRetiredDevices(bool wait = false);
     int InitializeDevices(libusb_device* dev = nullptr);
 
     void MonitorSuspendResume();
+    void ProcessSuspendBus();
+    void StopMonitorSuspendResume();
+
+    void ReloadConfig();
+    void MonitorConfig();
+    void StopMonitorConfig();
 
     int LIBUSB_CALL HotplugCallbackEnumerate(libusb_context* usb_context, libusb_device* dev,
                                              libusb_hotplug_event event, void* user_data);
@@ -7,13 +7,17 @@
 
 #include <log4cpp/Category.hh>
 #include <log4cpp/OstreamAppender.hh>
+#include <mutex>
 
-#define LOG(message) do { log4cpp::Category::getRoot() << message; std::cout.flush(); } while(0)
-#define ERR(message) do { log4cpp::Category::getRoot() << log4cpp::Priority::ERROR << message; std::cout.flush(); } while(0)
-#define DBG(message) do { log4cpp::Category::getRoot() << log4cpp::Priority::DEBUG << message; std::cout.flush(); } while(0)
-#define OUT(message) do { log4cpp::Category::getRoot() << log4cpp::Priority::INFO << message; std::cout.flush(); } while(0)
+// The log lock is recursive since the streamed message may itself call something that logs
+#define LOG(message) do { std::lock_guard log_lock(G13::log_mutex); log4cpp::Category::getRoot() << message; std::cout.flush(); } while(0)
+#define ERR(message) do { std::lock_guard log_lock(G13::log_mutex); log4cpp::Category::getRoot() << log4cpp::Priority::ERROR << message; std::cout.flush(); } while(0)
+#define DBG(message) do { std::lock_guard log_lock(G13::log_mutex); log4cpp::Category::getRoot() << log4cpp::Priority::DEBUG << message; std::cout.flush(); } while(0)
+#define OUT(message) do { std::lock_guard log_lock(G13::log_mutex); log4cpp::Category::getRoot() << log4cpp::Priority::INFO << message; std::cout.flush(); } while(0)
 
 namespace G13 {
+    extern std::recursive_mutex log_mutex;
+
     void start_logging();
     void stop_logging();
     void SetLogLevel(log4cpp::Priority::PriorityLevel lvl);
@@ -7,10 +7,12 @@
 
 #include <libusb-1.0/libusb.h>
 #include <map>
+#include <mutex>
 #include <string>
 #include <vector>
 
 #include "Objects/Device.hpp"
+#include "Objects/EventLoop.hpp"
 
 
 namespace G13 {
@@ -20,22 +22,25 @@ namespace G13 {
     constexpr size_t KEY_ENDPOINT = 1;
     constexpr size_t SCREEN_ENDPOINT = 2;
 
-    static std::map<std::string, std::string> stringConfigValues;
-
     extern libusb_context* usb_context;
     extern std::vector<Device*> g13s;
+    extern std::recursive_mutex g13s_mutex;
     extern libusb_hotplug_callback_handle usb_hotplug_cb_handle[3];
     extern libusb_device** devs;
     extern std::string logoFilename;
     extern const int class_id;
+    extern EventLoop* event_loop;
 
     void Initialize(int argc, char* argv[]);
     void printHelp();
     void Cleanup();
     void setLogoFilename(const std::string& newLogoFilename);
+    [[nodiscard]] bool isThreaded();
+    [[nodiscard]] bool isLegacyImages();
     std::string getStringConfigValue(const std::string& name);
     void setStringConfigValue(const std::string& name, const std::string& value);
     void SignalHandler(int);
+    int CompileConfig();
 
     int Run();
 }
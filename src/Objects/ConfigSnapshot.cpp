@@ -0,0 +1,434 @@
+//
+// Created by Britt Yazel on 03-16-2025.
+//
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <ranges>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Objects/ConfigSnapshot.hpp"
+#include "Objects/Device.hpp"
+#include "Objects/Key.hpp"
+#include "Utils/utilities.hpp"
+#include "exceptions.hpp"
+#include "log.hpp"
+
+namespace G13 {
+    ConfigSnapshot::ConfigSnapshot() : data(nullptr), size(0) {}
+
+    ConfigSnapshot::~ConfigSnapshot() {
+        Close();
+    }
+
+    // Compiles a bind file, and every file it loads, into a snapshot. Fails on the first unknown command,
+    // so a snapshot never holds anything the daemon would reject by name
+    bool ConfigSnapshot::Compile(const std::string& config_filename, const std::string& snapshot_filename) {
+        std::string output;
+        std::vector<std::string> sources;
+        if (!CompileToBuffer(config_filename, true, output, sources)) {
+            return false;
+        }
+
+        // Write next to the target and rename, so a running daemon never maps a half written snapshot
+        const std::string temporary_filename = snapshot_filename + ".tmp";
+        {
+            std::ofstream stream(temporary_filename, std::ios::binary | std::ios::trunc);
+            stream.write(output.data(), static_cast<std::streamsize>(output.size()));
+            if (!stream) {
+                ERR("failed writing " << temporary_filename);
+                return false;
+            }
+        }
+        if (rename(temporary_filename.c_str(), snapshot_filename.c_str()) < 0) {
+            ERR("failed writing " << snapshot_filename << ": " << strerror(errno));
+            remove(temporary_filename.c_str());
+            return false;
+        }
+
+        OUT("Compiled " << config_filename << " into " << snapshot_filename);
+        return true;
+    }
+
+    // Compiles a bind file into a complete snapshot, header included. When strict, the first bad line fails the
+    // whole compilation; otherwise bad lines are logged and left out, like they would be when loaded line by line
+    bool ConfigSnapshot::CompileToBuffer(const std::string& filename, const bool strict, std::string& output,
+                                         std::vector<std::string>& sources) {
+        std::vector<std::string> files_loading;
+        std::string records;
+        uint32_t record_count = 0;
+
+        if (!CompileFile(filename, strict, files_loading, sources, records, record_count)) {
+            return false;
+        }
+
+        Header header{};
+        memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+        header.version = SNAPSHOT_VERSION;
+        header.command_table_hash = Device::CommandTableHash();
+        header.record_count = record_count;
+
+        output.assign(reinterpret_cast<const char*>(&header), sizeof(header));
+        output += records;
+        return true;
+    }
+
+    bool ConfigSnapshot::CompileFile(const std::string& filename, const bool strict,
+                                     std::vector<std::string>& files_loading, std::vector<std::string>& sources,
+                                     std::string& records, uint32_t& record_count) {
+        // Relative loads are relative to the file doing the loading, as in Device::ReadCommandsFromFile()
+        auto filepath = std::filesystem::path(filename);
+        if (filepath.is_relative() && !files_loading.empty()) {
+            filepath = std::filesystem::path(files_loading.back()).replace_filename(filepath);
+        }
+        const std::string clean_filename = filepath.lexically_normal().string();
+
+        if (std::ranges::find(files_loading, clean_filename) != files_loading.end()) {
+            ERR(filename << " loading recursion");
+            return false;
+        }
+
+        // Remembered even if it can't be read, so creating it later still triggers a reload
+        sources.push_back(clean_filename);
+
+        std::ifstream stream(clean_filename);
+        if (!stream) {
+            ERR("failed reading " << clean_filename << ": " << strerror(errno));
+            return false;
+        }
+
+        files_loading.emplace_back(clean_filename);
+        bool success = true;
+        std::string line;
+        for (size_t line_number = 1; success && std::getline(stream, line); line_number++) {
+            try {
+                std::string_view remainder = line;
+                const std::string_view command = extract_and_advance_token(remainder);
+                if (command.empty()) {
+                    continue;
+                }
+
+                if (command == "load") {
+                    success = CompileFile(std::string(extract_and_advance_token(remainder)), strict, files_loading,
+                                          sources, records, record_count) || !strict;
+                    continue;
+                }
+
+                const int index = Device::FindCommandIndex(command);
+                if (index < 0) {
+                    throw CommandException("unknown command : " + std::string(command));
+                }
+                if (remainder.size() > UINT16_MAX) {
+                    throw CommandException("line too long");
+                }
+
+                const Record record = {static_cast<uint8_t>(index), 0, static_cast<uint16_t>(remainder.size())};
+                records.append(reinterpret_cast<const char*>(&record), sizeof(record));
+                records.append(remainder);
+                record_count++;
+            }
+            catch (const std::exception& ex) {
+                ERR(clean_filename << ":" << line_number << ": " << ex.what());
+                success = !strict;
+            }
+        }
+        files_loading.pop_back();
+        return success;
+    }
+
+    bool ConfigSnapshot::IsSnapshot(const std::string& filename) {
+        char magic[sizeof(SNAPSHOT_MAGIC)];
+        std::ifstream stream(filename, std::ios::binary);
+        return stream.read(magic, sizeof(magic)) && !memcmp(magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    }
+
+    // Loads a configuration for Apply(): a snapshot file is mapped as it is, a bind file is compiled in memory
+    bool ConfigSnapshot::Load(const std::string& filename) {
+        if (IsSnapshot(filename)) {
+            return Open(filename);
+        }
+
+        Close();
+        if (!CompileToBuffer(filename, false, compiled, sources)) {
+            compiled.clear();
+            return false;
+        }
+        data = compiled.data();
+        size = compiled.size();
+        return true;
+    }
+
+    bool ConfigSnapshot::Open(const std::string& filename) {
+        Close();
+
+        const int fid = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fid < 0) {
+            ERR("failed opening snapshot " << filename << ": " << strerror(errno));
+            return false;
+        }
+
+        struct stat file_stat{};
+        void* mapping = MAP_FAILED;
+        if (fstat(fid, &file_stat) == 0 && static_cast<size_t>(file_stat.st_size) >= sizeof(Header)) {
+            mapping = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_PRIVATE, fid, 0);
+        }
+        close(fid);
+        if (mapping == MAP_FAILED) {
+            ERR("failed mapping snapshot " << filename);
+            return false;
+        }
+        data = static_cast<const char*>(mapping);
+        size = file_stat.st_size;
+
+        Header header{};
+        memcpy(&header, data, sizeof(header));
+        if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) || header.version != SNAPSHOT_VERSION ||
+            header.command_table_hash != Device::CommandTableHash()) {
+            ERR(filename << " was compiled by a different g13d version, please recompile it");
+            Close();
+            return false;
+        }
+        sources = {filename};
+        return true;
+    }
+
+    void ConfigSnapshot::Close() {
+        if (data && data != compiled.data()) {
+            munmap(const_cast<char*>(data), size);
+        }
+        compiled.clear();
+        sources.clear();
+        data = nullptr;
+        size = 0;
+    }
+
+    bool ConfigSnapshot::empty() const {
+        return !data;
+    }
+
+    const std::vector<std::string>& ConfigSnapshot::getSources() const {
+        return sources;
+    }
+
+    // Calls callback with the command index and arguments of every record, in order
+    void ConfigSnapshot::ForEachCommand(
+        const std::function<void(size_t command, std::string_view remainder)>& callback) const {
+        if (!data) {
+            return;
+        }
+
+        Header header{};
+        memcpy(&header, data, sizeof(header));
+
+        size_t offset = sizeof(Header);
+        for (uint32_t index = 0; index < header.record_count; index++) {
+            Record record{};
+            if (size - offset < sizeof(record)) {
+                ERR("snapshot truncated after " << index << " commands");
+                return;
+            }
+            memcpy(&record, data + offset, sizeof(record));
+            offset += sizeof(record);
+            if (size - offset < record.length) {
+                ERR("snapshot truncated after " << index << " commands");
+                return;
+            }
+
+            callback(record.command, std::string_view(data + offset, record.length));
+            offset += record.length;
+        }
+    }
+
+    // Runs every command of the snapshot on a device and returns how many of them succeeded
+    size_t ConfigSnapshot::Apply(Device& g13) const {
+        size_t total = 0;
+        size_t applied = 0;
+        ForEachCommand([&](const size_t command, const std::string_view remainder) {
+            try {
+                g13.RunCommand(command, remainder);
+                applied++;
+            }
+            catch (const std::exception& ex) {
+                ERR("snapshot command " << total << " failed : " << ex.what());
+            }
+            total++;
+        });
+        g13.PublishBindings();
+
+        OUT("Applied " << applied << " of " << total << " snapshot commands");
+        return applied;
+    }
+
+    namespace {
+        struct ZoneState {
+            bool added = false;
+            std::string bounds;
+            std::string hysteresis;
+            // The whole command which set the action, since both bind and stickzone action can
+            std::string action;
+        };
+
+        // What a program leaves behind: key bindings per profile, stick zones, and every other command in order.
+        // Profiles are listed in the order the program created them, each with the profile it was copied from
+        struct ProgramState {
+            std::map<std::string, std::map<std::string, std::string>> bindings;
+            std::vector<std::string> profiles;
+            std::map<std::string, std::string> parents;
+            std::map<std::string, ZoneState> zones;
+            std::vector<std::string> settings;
+        };
+
+        ProgramState Evaluate(const ConfigSnapshot& program) {
+            ProgramState state;
+            std::string profile = "default";
+            state.bindings[profile] = {};
+            state.profiles.push_back(profile);
+
+            program.ForEachCommand([&](const size_t command, std::string_view remainder) {
+                const std::string_view name = Device::CommandName(command);
+                const std::string_view arguments = remainder;
+                try {
+                    if (name == "profile") {
+                        // Like Device::SwitchToProfile(), an unknown profile starts as a copy of the current one
+                        const std::string next(extract_and_advance_token(remainder));
+                        if (!state.bindings.contains(next)) {
+                            auto inherited = state.bindings[profile];
+                            state.bindings[next] = std::move(inherited);
+                            state.profiles.push_back(next);
+                            state.parents[next] = profile;
+                        }
+                        profile = next;
+                    }
+                    else if (name == "bind") {
+                        const std::string target(extract_and_advance_token(remainder));
+                        if (FindG13KeyValue(target) != BAD_KEY_VALUE) {
+                            state.bindings[profile][target] = left_trim(remainder);
+                        }
+                        else {
+                            state.zones[target].action = "bind" + std::string(arguments);
+                        }
+                    }
+                    else if (name == "stickzone") {
+                        const std::string_view operation = extract_and_advance_token(remainder);
+                        const std::string zone(extract_and_advance_token(remainder));
+                        if (operation == "smoothing") {
+                            state.settings.emplace_back(std::string(name) + std::string(arguments));
+                        }
+                        else if (operation == "add") {
+                            state.zones[zone].added = true;
+                        }
+                        else if (operation == "del") {
+                            state.zones.erase(zone);
+                        }
+                        else if (operation == "bounds") {
+                            state.zones[zone].bounds = left_trim(remainder);
+                        }
+                        else if (operation == "hysteresis") {
+                            state.zones[zone].hysteresis = left_trim(remainder);
+                        }
+                        else if (operation == "action") {
+                            state.zones[zone].action = "stickzone" + std::string(arguments);
+                        }
+                    }
+                    else {
+                        state.settings.emplace_back(std::string(name) + std::string(arguments));
+                    }
+                }
+                catch (const std::exception&) {
+                    // Replayed as it is, so it fails the same way it did when the program was applied
+                    state.settings.emplace_back(std::string(name) + std::string(arguments));
+                }
+            });
+            return state;
+        }
+    }
+
+    // The commands that take a device configured by from to where to would have left it, without touching
+    // the bindings and zones which did not change. The "profile" switches in the result have to be undone by
+    // whoever runs them, so the active profile survives
+    std::vector<std::string> ConfigSnapshot::Diff(const ConfigSnapshot& from, const ConfigSnapshot& to) {
+        const ProgramState old_state = Evaluate(from);
+        const ProgramState new_state = Evaluate(to);
+        std::vector<std::string> commands;
+
+        // Commands like rgb or font don't leave anything behind that can be compared, so if any of them
+        // changed, all of them are run again in their new order
+        if (old_state.settings != new_state.settings) {
+            commands.insert(commands.end(), new_state.settings.begin(), new_state.settings.end());
+        }
+
+        for (const auto& [name, zone] : old_state.zones) {
+            if (zone.added && !new_state.zones.contains(name)) {
+                commands.emplace_back("stickzone del " + name);
+            }
+        }
+        for (const auto& [name, zone] : new_state.zones) {
+            const auto old_zone = old_state.zones.find(name);
+            const ZoneState unchanged = old_zone != old_state.zones.end() ? old_zone->second : ZoneState();
+            if (zone.added && !unchanged.added) {
+                commands.emplace_back("stickzone add " + name);
+            }
+            if (!zone.bounds.empty() && zone.bounds != unchanged.bounds) {
+                commands.emplace_back("stickzone bounds " + name + " " + zone.bounds);
+            }
+            if (zone.hysteresis != unchanged.hysteresis) {
+                commands.emplace_back("stickzone hysteresis " + name + " " +
+                    (zone.hysteresis.empty() ? "0 0" : zone.hysteresis));
+            }
+            if (!zone.action.empty() && zone.action != unchanged.action) {
+                commands.emplace_back(zone.action);
+            }
+        }
+
+        // Profiles are visited in the order the new program creates them, so a profile it creates is copied
+        // from its parent after the parent got its own changes, the same as on a fresh load. Its bindings are
+        // then compared against that copy rather than against nothing
+        const std::map<std::string, std::string> no_bindings;
+        std::vector<std::string> profiles = new_state.profiles;
+        for (const auto& profile : old_state.profiles) {
+            if (!new_state.bindings.contains(profile)) {
+                profiles.push_back(profile);
+            }
+        }
+        for (const auto& profile : profiles) {
+            const auto new_iter = new_state.bindings.find(profile);
+            const auto& new_bindings = new_iter != new_state.bindings.end() ? new_iter->second : no_bindings;
+
+            std::vector<std::string> changes;
+            const std::map<std::string, std::string>* old_bindings = &no_bindings;
+            if (const auto old_iter = old_state.bindings.find(profile); old_iter != old_state.bindings.end()) {
+                old_bindings = &old_iter->second;
+            }
+            else {
+                const std::string& parent = new_state.parents.at(profile);
+                old_bindings = &new_state.bindings.at(parent);
+                changes.emplace_back("profile " + parent);
+            }
+
+            std::vector<std::string> bindings;
+            for (const auto& key : *old_bindings | std::views::keys) {
+                if (!new_bindings.contains(key)) {
+                    bindings.emplace_back("delete key " + key);
+                }
+            }
+            for (const auto& [key, action] : new_bindings) {
+                if (const auto old_binding = old_bindings->find(key);
+                    old_binding == old_bindings->end() || old_binding->second != action) {
+                    bindings.emplace_back("bind " + key + " " + action);
+                }
+            }
+            if (!changes.empty() || !bindings.empty()) {
+                changes.emplace_back("profile " + profile);
+                changes.insert(changes.end(), bindings.begin(), bindings.end());
+                commands.insert(commands.end(), changes.begin(), changes.end());
+            }
+        }
+        return commands;
+    }
+}
@@ -0,0 +1,202 @@
+//
+// Created by Britt Yazel on 03-16-2025.
+//
+
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "Objects/ControlSocket.hpp"
+#include "Objects/Device.hpp"
+#include "log.hpp"
+
+namespace G13 {
+    // *************************************************************************
+
+    ControlClient::ControlClient(const int fid) : fid(fid), input(COMMAND_BUFFER_SIZE), closing(false) {}
+
+    ControlClient::~ControlClient() {
+        close(fid);
+    }
+
+    void ControlClient::Reply(const std::string& id, const char* error) {
+        if (closing) {
+            return;
+        }
+        if (!id.empty()) {
+            output += id;
+            output += ' ';
+        }
+        if (error) {
+            output += "ERR ";
+            output += error;
+        }
+        else {
+            output += "OK";
+        }
+        output += '\n';
+
+        if (output.size() > CONTROL_CLIENT_MAX_BUFFER) {
+            ERR("control client " << fid << " is not reading its replies, disconnecting");
+            closing = true;
+        }
+    }
+
+    // Writes as much of the queued output as the socket takes. Returns false once the client is gone
+    bool ControlClient::Flush() {
+        while (!output.empty()) {
+            const ssize_t written = send(fid, output.data(), output.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            output.erase(0, written);
+        }
+        return true;
+    }
+
+    // *************************************************************************
+
+    ControlSocket::ControlSocket(Device& device) : device(device), listen_fid(-1) {}
+
+    ControlSocket::~ControlSocket() {
+        Close();
+    }
+
+    bool ControlSocket::Open(const std::string& path, const mode_t umask) {
+        Close();
+
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path)) {
+            ERR("control socket path too long: " << path);
+            return false;
+        }
+        memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+        if (const std::filesystem::path dir_path = std::filesystem::path(path).parent_path(); !dir_path.empty()) {
+            create_directories(dir_path);
+        }
+        // A socket left behind by an earlier run would make bind() fail
+        remove(path.c_str());
+
+        listen_fid = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listen_fid < 0) {
+            ERR("failed creating control socket: " << strerror(errno));
+            return false;
+        }
+        if (bind(listen_fid, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 ||
+            listen(listen_fid, SOMAXCONN) < 0) {
+            ERR("failed binding control socket " << path << ": " << strerror(errno));
+            close(listen_fid);
+            listen_fid = -1;
+            return false;
+        }
+        chmod(path.c_str(), 0777 & ~umask);
+        this->path = path;
+
+        device.getEventLoopRef().Watch(listen_fid, EPOLLIN, [this](uint32_t) {
+            Accept();
+        });
+        return true;
+    }
+
+    void ControlSocket::Close() {
+        while (!clients.empty()) {
+            DropClient(clients.begin()->first);
+        }
+        if (listen_fid >= 0) {
+            device.getEventLoopRef().Unwatch(listen_fid);
+            close(listen_fid);
+            remove(path.c_str());
+            listen_fid = -1;
+        }
+    }
+
+    size_t ControlSocket::getClientCount() const {
+        return clients.size();
+    }
+
+    void ControlSocket::Accept() {
+        while (true) {
+            const int client_fid = accept4(listen_fid, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (client_fid < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    ERR("failed accepting control client: " << strerror(errno));
+                }
+                return;
+            }
+
+            clients[client_fid] = std::make_unique<ControlClient>(client_fid);
+            device.getEventLoopRef().Watch(client_fid, EPOLLIN, [this, client_fid](const uint32_t events) {
+                if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    ReadClient(client_fid);
+                }
+                else if (const auto iter = clients.find(client_fid); iter != clients.end()) {
+                    if (!iter->second->Flush()) {
+                        DropClient(client_fid);
+                    }
+                    else {
+                        UpdateInterest(*iter->second);
+                    }
+                }
+            });
+            DBG("control client " << client_fid << " connected");
+        }
+    }
+
+    // Reads everything the client sent so far, runs every complete message and sends back the replies
+    void ControlSocket::ReadClient(const int client_fid) {
+        const auto iter = clients.find(client_fid);
+        if (iter == clients.end()) {
+            return;
+        }
+        ControlClient& client = *iter->second;
+
+        bool hangup = false;
+        while (!client.closing) {
+            if (client.input.full()) {
+                ERR("control client " << client_fid << " sent an oversized message, disconnecting");
+                client.closing = true;
+                break;
+            }
+
+            const ssize_t read_result = client.input.Read(client_fid);
+            if (read_result < 0 && errno == EINTR) {
+                continue;
+            }
+            if (read_result <= 0) {
+                hangup = read_result == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+                break;
+            }
+            client.input.Consume(device.ProcessBuffer(client.input.data(), client.input.size(), &client));
+        }
+
+        if (!client.Flush() || client.closing || hangup) {
+            DropClient(client_fid);
+            return;
+        }
+        UpdateInterest(client);
+    }
+
+    void ControlSocket::DropClient(const int client_fid) {
+        device.getEventLoopRef().Unwatch(client_fid);
+        clients.erase(client_fid);
+        DBG("control client " << client_fid << " disconnected");
+    }
+
+    // Only ask for EPOLLOUT while there are replies the socket didn't take yet
+    void ControlSocket::UpdateInterest(const ControlClient& client) const {
+        device.getEventLoopRef().Modify(client.fid, client.output.empty() ? EPOLLIN : EPOLLIN | EPOLLOUT);
+    }
+}
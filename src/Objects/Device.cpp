@@ -2,12 +2,20 @@
 // Created by Britt Yazel on 03-16-2025.
 //
 
+#include <algorithm>
+#include <array>
+#include <cctype>
 #include <filesystem>
 #include <fstream>
 #include <ranges>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "Objects/CommandAction.hpp"
+#include "Objects/ConfigSnapshot.hpp"
 #include "Objects/KeyAction.hpp"
 #include "Objects/PipeOutAction.hpp"
 #include "Objects/Device.hpp"
@@ -22,45 +30,171 @@
 #include "Objects/StickZone.hpp"
 
 namespace G13 {
+    namespace {
+        // FNV-1a, salted with a seed that is picked at compile time to give every command its own slot
+        constexpr size_t CommandHash(const std::string_view name, const uint32_t seed) {
+            uint32_t hash = 2166136261u ^ seed;
+            for (const char character : name) {
+                hash ^= static_cast<unsigned char>(character);
+                hash *= 16777619u;
+            }
+            return hash & (COMMAND_HASH_SLOTS - 1);
+        }
+
+        template <size_t N, class ENTRY>
+        consteval uint32_t FindCommandHashSeed(const ENTRY (&entries)[N]) {
+            static_assert(N <= COMMAND_HASH_SLOTS, "more commands than hash slots");
+            for (uint32_t seed = 0; seed < 100000; seed++) {
+                bool used[COMMAND_HASH_SLOTS]{};
+                bool perfect = true;
+                for (const auto& entry : entries) {
+                    const size_t slot = CommandHash(entry.name, seed);
+                    if (used[slot]) {
+                        perfect = false;
+                        break;
+                    }
+                    used[slot] = true;
+                }
+                if (perfect) {
+                    return seed;
+                }
+            }
+            return UINT32_MAX;
+        }
+    }
+
+    // The fixed command set, looked up through a perfect hash of the command names that is built at compile time
+    struct Device::CommandTable {
+        static constexpr CommandEntry entries[] = {
+            {"out", &Device::CommandOut},
+            {"pos", &Device::CommandPos},
+            {"bind", &Device::CommandBind},
+            {"profile", &Device::CommandProfile},
+            {"font", &Device::CommandFont},
+            {"mod", &Device::CommandMod},
+            {"textmode", &Device::CommandTextMode},
+            {"rgb", &Device::CommandRgb},
+            {"stickmode", &Device::CommandStickMode},
+            {"stickzone", &Device::CommandStickZone},
+            {"dump", &Device::CommandDump},
+            {"log_level", &Device::CommandLogLevel},
+            {"refresh", &Device::CommandRefresh},
+            {"present", &Device::CommandPresent},
+            {"clear", &Device::CommandClear},
+            {"delete", &Device::CommandDelete},
+            {"load", &Device::CommandLoad},
+        };
+        static_assert(std::size(entries) < UINT8_MAX);
+
+        static constexpr uint32_t seed = FindCommandHashSeed(entries);
+        static_assert(seed != UINT32_MAX, "no collision free hash seed for the command names");
+
+        // Index into entries for every hash slot, UINT8_MAX for empty slots
+        static constexpr auto slots = [] {
+            std::array<uint8_t, COMMAND_HASH_SLOTS> slots{};
+            slots.fill(UINT8_MAX);
+            for (size_t index = 0; index < std::size(entries); index++) {
+                slots[CommandHash(entries[index].name, seed)] = index;
+            }
+            return slots;
+        }();
+
+        static constexpr uint32_t names_hash = [] {
+            uint32_t hash = 2166136261u;
+            for (const auto& entry : entries) {
+                for (const char character : entry.name) {
+                    hash = (hash ^ static_cast<unsigned char>(character)) * 16777619u;
+                }
+                hash = (hash ^ ' ') * 16777619u;
+            }
+            return hash;
+        }();
+    };
+
     // *************************************************************************
 
     // Constructor
     Device::Device(libusb_device* usb_device, libusb_context* usb_context, libusb_device_handle* usb_handle,
-                           const int device_index) : device_index(device_index), usb_context(usb_context),
-                                                     uinput_fid(-1), screen(*this), stick(*this),
-                                                     usb_handle(usb_handle), usb_device(usb_device) {
+                           const int device_index) : event_batch_count(0), device_index(device_index),
+                                                     usb_context(usb_context),
+                                                     uinput_fid(-1), pointer_fid(-1), input_pipe_fid(-1),
+                                                     input_pipe_buffer(COMMAND_BUFFER_SIZE), output_pipe_fid(-1),
+                                                     framebuffer_fid(-1), framebuffer(nullptr),
+                                                     active_bindings(nullptr), input_epoch(0), bindings_held(0),
+                                                     screen(*this), stick(*this), held_bindings(0),
+                                                     usb_handle(usb_handle), usb_device(usb_device),
+                                                     pending_transfers(0), closing(false), thread_running(false),
+                                                     wake_fid(-1), report_head(0), report_count(0),
+                                                     control_socket(*this) {
         current_profile = std::make_shared<Profile>(*this, "default");
         profiles["default"] = current_profile;
+        PublishBindings();
 
         connected = true;
-
-        for (bool& key : keys) {
-            key = false;
-        }
+        key_states = 0;
 
         getScreenRef().image_clear();
 
         InitFonts();
-        InitCommands();
+
+        if (isThreaded()) {
+            device_loop = std::make_unique<EventLoop>();
+            report_queue.resize(REPORT_QUEUE_SIZE * REPORT_SIZE);
+            wake_fid = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            device_loop->Watch(wake_fid, EPOLLIN, [this](uint32_t) {
+                uint64_t value;
+                IGUR(read(wake_fid, &value, sizeof(value)));
+                DrainReports();
+            });
+        }
     }
 
     // Destructor
     Device::~Device() {
         Cleanup();
+
+        if (wake_fid >= 0) {
+            close(wake_fid);
+            wake_fid = -1;
+        }
+
+        if (usb_handle) {
+            libusb_release_interface(usb_handle, 0);
+            libusb_close(usb_handle);
+            usb_handle = nullptr;
+        }
+
+        for (auto& transfer : input_transfers) {
+            if (transfer) {
+                libusb_free_transfer(transfer);
+                transfer = nullptr;
+            }
+        }
     }
 
     // *************************************************************************
 
+    // Releases everything but the USB handle, which has to outlive the in-flight transfers.
+    // The handle itself is closed by the destructor once HasPendingTransfers() returns false.
     void Device::Cleanup() {
-        if (usb_handle) {
+        if (usb_handle && !closing) {
+            StopThread();
+            closing = true;
+            CancelInputTransfers();
+            getScreenRef().StopCompositor();
+            getStickRef().StopSmoothing();
+            getStickRef().StopMotion();
+            getScreenRef().CancelTransfer();
             SetKeyColor(0, 0, 0);
-            remove(input_pipe_name.c_str());
-            remove(output_pipe_name.c_str());
+            ClosePipes();
+            CloseFramebuffer();
             ioctl(uinput_fid, UI_DEV_DESTROY);
             close(uinput_fid);
-            libusb_release_interface(usb_handle, 0);
-            libusb_close(usb_handle);
-            usb_handle = nullptr;
+            if (pointer_fid >= 0) {
+                ioctl(pointer_fid, UI_DEV_DESTROY);
+                close(pointer_fid);
+                pointer_fid = -1;
+            }
         }
     }
 
@@ -77,67 +211,356 @@ namespace G13 {
         SetKeyColor(red, green, blue);
 
         uinput_fid = G13CreateUinput();
+        pointer_fid = G13CreatePointerUinput();
+        ClosePipes();
+        CloseFramebuffer();
         MakePipeNames();
         input_pipe_fid = G13CreateFifo(input_pipe_name.c_str(), S_IRGRP | S_IROTH);
 
         if (input_pipe_fid == -1) {
             ERR("failed opening input pipe " << input_pipe_name);
         }
+        else {
+            getEventLoopRef().Watch(input_pipe_fid, EPOLLIN, [this](uint32_t) {
+                if (!suspended) {
+                    ReadCommandsFromPipe();
+                }
+            });
+        }
 
         output_pipe_fid = G13CreateFifo(output_pipe_name.c_str(), S_IWGRP | S_IWOTH);
 
         if (output_pipe_fid == -1) {
             ERR("failed opening output pipe " << output_pipe_name);
         }
+
+        control_socket.Open(control_socket_name, std::stoi(std::string("0") + getStringConfigValue("umask"), nullptr, 8));
+
+        CreateFramebuffer();
+    }
+
+    // Creates the shared LCD framebuffer next to the pipes. Clients map the same file, draw into it in place
+    // and then send "present" to have the compositor pick the frame up, without pushing it through the pipe
+    void Device::CreateFramebuffer() {
+        const mode_t umask = std::stoi(std::string("0") + getStringConfigValue("umask"), nullptr, 8);
+        framebuffer_fid = open(framebuffer_name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+        if (framebuffer_fid < 0) {
+            ERR("failed opening framebuffer " << framebuffer_name << ": " << strerror(errno));
+            return;
+        }
+        fchmod(framebuffer_fid, 0666 & ~umask);
+
+        if (ftruncate(framebuffer_fid, SCREEN_BUF_SIZE) < 0) {
+            ERR("failed sizing framebuffer " << framebuffer_name << ": " << strerror(errno));
+            CloseFramebuffer();
+            return;
+        }
+
+        void* mapping = mmap(nullptr, SCREEN_BUF_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, framebuffer_fid, 0);
+        if (mapping == MAP_FAILED) {
+            ERR("failed mapping framebuffer " << framebuffer_name << ": " << strerror(errno));
+            CloseFramebuffer();
+            return;
+        }
+        framebuffer = static_cast<unsigned char*>(mapping);
+    }
+
+    void Device::CloseFramebuffer() {
+        if (framebuffer) {
+            getScreenRef().Present(nullptr);
+            munmap(framebuffer, SCREEN_BUF_SIZE);
+            framebuffer = nullptr;
+        }
+        if (framebuffer_fid >= 0) {
+            close(framebuffer_fid);
+            remove(framebuffer_name.c_str());
+            framebuffer_fid = -1;
+        }
+    }
+
+    void Device::ClosePipes() {
+        control_socket.Close();
+        if (input_pipe_fid >= 0) {
+            getEventLoopRef().Unwatch(input_pipe_fid);
+            close(input_pipe_fid);
+            remove(input_pipe_name.c_str());
+        }
+        input_pipe_buffer.Clear();
+        if (output_pipe_fid >= 0) {
+            close(output_pipe_fid);
+            remove(output_pipe_name.c_str());
+        }
+        input_pipe_fid = -1;
+        output_pipe_fid = -1;
+    }
+
+    // Runs work on the thread that owns this device: right away without --threaded, otherwise on device_thread
+    void Device::Post(std::function<void()> work) {
+        if (device_loop) {
+            device_loop->Post(std::move(work));
+        }
+        else {
+            work();
+        }
+    }
+
+    // Runs the changes a config reload worked out, see ConfigSnapshot::Diff(), and stays on the active profile
+    void Device::ApplyConfigChanges(const std::vector<std::string>& commands) {
+        const std::string profile = getCurrentProfileRef().name();
+        bindings_held++;
+        for (const auto& command : commands) {
+            Command(command, "reload");
+        }
+        SwitchToProfile(profile);
+        bindings_held--;
+        PublishBindings();
+    }
+
+    // Starts the input/action thread used with --threaded. Everything the device does after this point,
+    // including running pipe commands and key actions, happens on that thread
+    void Device::StartThread() {
+        if (!device_loop || thread_running) {
+            return;
+        }
+
+        thread_running = true;
+        device_thread = std::thread([this] {
+            while (thread_running) {
+                device_loop->RunOnce();
+            }
+        });
+    }
+
+    void Device::StopThread() {
+        if (!thread_running) {
+            return;
+        }
+
+        thread_running = false;
+        constexpr uint64_t value = 1;
+        IGUR(write(wake_fid, &value, sizeof(value)));
+        device_thread.join();
     }
 
     void Device::MakePipeNames() {
         if (const std::string config_pipe_dir = getStringConfigValue("pipe_dir"); !config_pipe_dir.empty()) {
             input_pipe_name = config_pipe_dir + "/g13-" + std::to_string(getDeviceIndex());
             output_pipe_name = config_pipe_dir + "/g13-" + std::to_string(getDeviceIndex()) + "_out";
+            framebuffer_name = config_pipe_dir + "/g13-" + std::to_string(getDeviceIndex()) + "_fb";
+            control_socket_name = config_pipe_dir + "/g13-" + std::to_string(getDeviceIndex()) + ".sock";
         }
         else {
-            // Default to CONTROL_DIR: i.e. /run/g13/g13-0 and /run/g13/g13-0_out
+            // Default to CONTROL_DIR: i.e. /run/g13/g13-0, /run/g13/g13-0_out, /run/g13/g13-0_fb and /run/g13/g13-0.sock
             input_pipe_name = std::string(CONTROL_DIR) + "/g13-" + std::to_string(getDeviceIndex());
             output_pipe_name = std::string(CONTROL_DIR) + "/g13-" + std::to_string(getDeviceIndex()) + "_out";
+            framebuffer_name = std::string(CONTROL_DIR) + "/g13-" + std::to_string(getDeviceIndex()) + "_fb";
+            control_socket_name = std::string(CONTROL_DIR) + "/g13-" + std::to_string(getDeviceIndex()) + ".sock";
+        }
+    }
+
+    // Calibration is kept per physical G13: by its USB serial number if it has one, otherwise by the USB port
+    // it is plugged into, so it survives restarts and replugging into the same port
+    void Device::MakeCalibrationName() {
+        std::string id;
+        libusb_device_descriptor descriptor{};
+        if (usb_handle && libusb_get_device_descriptor(usb_device, &descriptor) == LIBUSB_SUCCESS &&
+            descriptor.iSerialNumber) {
+            unsigned char serial[128];
+            if (const int length = libusb_get_string_descriptor_ascii(usb_handle, descriptor.iSerialNumber, serial,
+                                                                      sizeof(serial)); length > 0) {
+                id = "serial-" + std::string(reinterpret_cast<char*>(serial), length);
+            }
+        }
+        if (id.empty()) {
+            uint8_t ports[8];
+            const int count = libusb_get_port_numbers(usb_device, ports, sizeof(ports));
+            id = "port-" + std::to_string(libusb_get_bus_number(usb_device));
+            for (int i = 0; i < count; i++) {
+                id += (i ? '.' : '-') + std::to_string(ports[i]);
+            }
+        }
+        // Serial numbers are whatever the device says they are
+        std::ranges::replace_if(id, [](const char character) {
+            return !std::isalnum(static_cast<unsigned char>(character)) && character != '-' && character != '.';
+        }, '_');
+
+        const std::string config_state_dir = getStringConfigValue("state_dir");
+        calibration_name = (config_state_dir.empty() ? std::string(STATE_DIR) : config_state_dir) + "/g13-" + id +
+            ".cal";
+    }
+
+    void Device::LoadCalibration() {
+        MakeCalibrationName();
+        if (getStickRef().LoadCalibration(calibration_name)) {
+            OUT("Loaded stick calibration " << calibration_name);
+        }
+    }
+
+    // Called whenever a calibration mode is left
+    void Device::SaveCalibration() const {
+        if (!calibration_name.empty() && stick.SaveCalibration(calibration_name)) {
+            OUT("Saved stick calibration " << calibration_name);
         }
     }
 
     // ************************************************************************
 
-    // Reads and processes key state report from G13
-    int Device::ReadDeviceInputs() {
-        // If not connected or suspended, stop here
-        if (!connected || suspended) {
-            return 1;
+    // Queues INPUT_TRANSFER_COUNT interrupt IN transfers on the key endpoint. Each one is resubmitted from
+    // InputTransferCallback, so there is always a transfer waiting for the next report.
+    int Device::StartInputTransfers() {
+        if (closing || pending_transfers > 0) {
+            return 0;
         }
 
-        unsigned char buffer[REPORT_SIZE];
-        int size = 0;
-        const int error = libusb_interrupt_transfer(usb_handle, LIBUSB_ENDPOINT_IN | KEY_ENDPOINT, buffer,
-                                                    REPORT_SIZE, &size, 100);
+        for (auto& transfer : input_transfers) {
+            if (!transfer) {
+                transfer = libusb_alloc_transfer(0);
+                if (!transfer) {
+                    ERR("Unable to allocate key transfer");
+                    return 1;
+                }
+                const auto buffer = static_cast<unsigned char*>(malloc(REPORT_SIZE));
+                libusb_fill_interrupt_transfer(transfer, usb_handle, LIBUSB_ENDPOINT_IN | KEY_ENDPOINT, buffer,
+                                               REPORT_SIZE, InputTransferCallback, this, 0);
+                transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+            }
 
-        if (error && error != LIBUSB_ERROR_TIMEOUT) {
-            ERR("Error while reading keys: " << DescribeLibusbErrorCode(error));
-            if (error == LIBUSB_ERROR_NO_DEVICE || error == LIBUSB_ERROR_IO) {
-                DBG("Giving libusb a nudge");
-                libusb_handle_events(usb_context);
+            if (const int error = libusb_submit_transfer(transfer); error != LIBUSB_SUCCESS) {
+                ERR("Error submitting key transfer: " << DescribeLibusbErrorCode(error));
+                return 1;
             }
+            pending_transfers++;
         }
+        return 0;
+    }
 
-        if (size == REPORT_SIZE) {
-            getStickRef().ParseJoystick(buffer);
-            getCurrentProfileRef().ParseKeys(buffer);
-            SendEvent(EV_SYN, SYN_REPORT, 0);
+    void Device::CancelInputTransfers() {
+        for (const auto transfer : input_transfers) {
+            if (transfer) {
+                // Transfers which already completed report LIBUSB_ERROR_NOT_FOUND, which is fine
+                libusb_cancel_transfer(transfer);
+            }
         }
-        return 0;
     }
 
-    bool Device::updateKeyState(const int key, const bool state) {
-        // state == true if key is pressed
-        const bool oldState = keys[key];
-        keys[key] = state;
-        return oldState != state;
+    bool Device::HasPendingTransfers() {
+        return pending_transfers > 0 || getScreenRef().HasPendingTransfer();
+    }
+
+    size_t Device::InputTransferIndex(const libusb_transfer* transfer) const {
+        return std::ranges::find(input_transfers, transfer) - std::begin(input_transfers);
+    }
+
+    // Counts a failed key transfer and clears the halt of a stalled endpoint. Returns false once the transfer
+    // failed MAX_INPUT_TRANSFER_FAILURES times in a row and should not be resubmitted anymore
+    bool Device::InputTransferFailed(libusb_transfer* transfer) {
+        const size_t index = InputTransferIndex(transfer);
+        ERR("Error while reading keys: transfer status " << transfer->status);
+
+        if (transfer->status == LIBUSB_TRANSFER_STALL) {
+            if (const int error = libusb_clear_halt(usb_handle, transfer->endpoint); error != LIBUSB_SUCCESS) {
+                ERR("Error clearing key endpoint halt: " << DescribeLibusbErrorCode(error));
+            }
+        }
+
+        if (++input_transfer_failures[index] >= MAX_INPUT_TRANSFER_FAILURES) {
+            ERR("Key transfer failed " << input_transfer_failures[index] << " times in a row, giving up on it");
+            return false;
+        }
+        return true;
+    }
+
+    void LIBUSB_CALL Device::InputTransferCallback(libusb_transfer* transfer) {
+        const auto g13 = static_cast<Device*>(transfer->user_data);
+
+        switch (transfer->status) {
+        case LIBUSB_TRANSFER_COMPLETED:
+            g13->input_transfer_failures[g13->InputTransferIndex(transfer)] = 0;
+            if (transfer->actual_length == REPORT_SIZE && !suspended && !g13->closing) {
+                if (g13->device_loop) {
+                    g13->QueueReport(transfer->buffer);
+                }
+                else {
+                    g13->ProcessReport(transfer->buffer);
+                }
+            }
+            break;
+        case LIBUSB_TRANSFER_CANCELLED:
+        case LIBUSB_TRANSFER_NO_DEVICE:
+            g13->pending_transfers--;
+            return;
+        default:
+            // A transfer which keeps failing, on a stalled endpoint for instance, would otherwise be resubmitted
+            // over and over as fast as it fails
+            if (!g13->InputTransferFailed(transfer)) {
+                g13->pending_transfers--;
+                return;
+            }
+            break;
+        }
+
+        if (g13->closing) {
+            g13->pending_transfers--;
+            return;
+        }
+
+        if (const int error = libusb_submit_transfer(transfer); error != LIBUSB_SUCCESS) {
+            ERR("Error resubmitting key transfer: " << DescribeLibusbErrorCode(error));
+            g13->pending_transfers--;
+        }
+    }
+
+    // Hands a report from the USB event thread over to device_thread
+    void Device::QueueReport(const unsigned char* report) {
+        {
+            std::lock_guard lock(report_mutex);
+            if (report_count == REPORT_QUEUE_SIZE) {
+                // The device thread is stuck; drop the oldest report rather than blocking USB handling
+                DBG("Report queue of device " << device_index << " full, dropping a report");
+                report_head = (report_head + 1) % REPORT_QUEUE_SIZE;
+                report_count--;
+            }
+            const size_t slot = (report_head + report_count) % REPORT_QUEUE_SIZE;
+            memcpy(&report_queue[slot * REPORT_SIZE], report, REPORT_SIZE);
+            report_count++;
+        }
+
+        constexpr uint64_t value = 1;
+        IGUR(write(wake_fid, &value, sizeof(value)));
+    }
+
+    void Device::DrainReports() {
+        unsigned char report[REPORT_SIZE];
+        while (true) {
+            {
+                std::lock_guard lock(report_mutex);
+                if (!report_count) {
+                    return;
+                }
+                memcpy(report, &report_queue[report_head * REPORT_SIZE], REPORT_SIZE);
+                report_head = (report_head + 1) % REPORT_QUEUE_SIZE;
+                report_count--;
+            }
+            ProcessReport(report);
+        }
+    }
+
+    // Processes one key state report from the G13. Everything it produces reaches uinput in a single write
+    void Device::ProcessReport(const unsigned char* report) {
+        getStickRef().ParseJoystick(report);
+
+        input_epoch.fetch_add(1);
+        Profile::ParseKeys(*this, *active_bindings.load(), report);
+        input_epoch.fetch_add(1);
+
+        FlushEvents();
+    }
+
+    // Stores the 40-bit key word of a report (bit n set if key n is pressed) and returns the bits which changed
+    uint64_t Device::UpdateKeyStates(const uint64_t states) {
+        const uint64_t changed = states ^ key_states;
+        key_states = states;
+        return changed;
     }
 
     int Device::getDeviceIndex() const {
@@ -160,6 +583,10 @@ namespace G13 {
         return *current_profile;
     }
 
+    EventLoop& Device::getEventLoopRef() const {
+        return device_loop ? *device_loop : *event_loop;
+    }
+
     libusb_device* Device::getDevicePtr() const {
         return usb_device;
     }
@@ -169,6 +596,7 @@ namespace G13 {
     }
 
     Device* Device::GetG13DeviceHandle(const libusb_device* dev) {
+        std::lock_guard lock(g13s_mutex);
         for (const auto g13 : g13s) {
             if (dev == g13->getDevicePtr()) {
                 return g13;
@@ -198,8 +626,7 @@ namespace G13 {
         return fd;
     }
 
-    int Device::G13CreateUinput() {
-        uinput_user_dev new_uinput{};
+    int Device::G13OpenUinput() {
         const char* dev_uinput_filename = access("/dev/input/uinput", F_OK) == 0
                                               ? "/dev/input/uinput"
                                               : access("/dev/uinput", F_OK) == 0
@@ -218,9 +645,13 @@ namespace G13 {
             ERR("Could not open uinput");
             return -1;
         }
+        return ufile;
+    }
+
+    int Device::G13RegisterUinput(const int ufile, const char* name) {
+        uinput_user_dev new_uinput{};
         memset(&new_uinput, 0, sizeof(new_uinput));
-        constexpr char name[] = "G13";
-        memcpy(new_uinput.name, name, sizeof(name));
+        strncpy(new_uinput.name, name, sizeof(new_uinput.name) - 1);
         new_uinput.id.version = 1;
         new_uinput.id.bustype = BUS_USB;
         new_uinput.id.product = PRODUCT_ID;
@@ -230,6 +661,27 @@ namespace G13 {
         new_uinput.absmax[ABS_X] = 0xff;
         new_uinput.absmax[ABS_Y] = 0xff;
 
+        ssize_t return_code = write(ufile, &new_uinput, sizeof(new_uinput));
+        if (return_code < 0) {
+            ERR("Could not write to uinput device (" << return_code << ")");
+            close(ufile);
+            return -1;
+        }
+        return_code = ioctl(ufile, UI_DEV_CREATE);
+        if (return_code) {
+            ERR("Error creating uinput device for " << name);
+            close(ufile);
+            return -1;
+        }
+        return ufile;
+    }
+
+    int Device::G13CreateUinput() {
+        const int ufile = G13OpenUinput();
+        if (ufile < 0) {
+            return -1;
+        }
+
         ioctl(ufile, UI_SET_EVBIT, EV_KEY);
         ioctl(ufile, UI_SET_EVBIT, EV_ABS);
         ioctl(ufile, UI_SET_MSCBIT, MSC_SCAN);
@@ -246,28 +698,121 @@ namespace G13 {
         }
         ioctl(ufile, UI_SET_KEYBIT, BTN_THUMB);
 
-        ssize_t return_code = write(ufile, &new_uinput, sizeof(new_uinput));
-        if (return_code < 0) {
-            ERR("Could not write to uinput device (" << return_code << ")");
-            return -1;
-        }
-        return_code = ioctl(ufile, UI_DEV_CREATE);
-        if (return_code) {
-            ERR("Error creating uinput device for G13");
+        return G13RegisterUinput(ufile, "G13");
+    }
+
+    // The pointer and wheels of the MOUSE and SCROLL stick modes. They get a device of their own: with the
+    // absolute stick axes and BTN_THUMB next to them, udev tags the main device as a joystick, and libinput
+    // would ignore its relative motion. Relative axes plus mouse buttons make this one a mouse instead
+    int Device::G13CreatePointerUinput() {
+        const int ufile = G13OpenUinput();
+        if (ufile < 0) {
             return -1;
         }
-        return ufile;
+
+        ioctl(ufile, UI_SET_EVBIT, EV_KEY);
+        ioctl(ufile, UI_SET_EVBIT, EV_REL);
+        ioctl(ufile, UI_SET_KEYBIT, BTN_LEFT);
+        ioctl(ufile, UI_SET_KEYBIT, BTN_RIGHT);
+        ioctl(ufile, UI_SET_KEYBIT, BTN_MIDDLE);
+        ioctl(ufile, UI_SET_RELBIT, REL_X);
+        ioctl(ufile, UI_SET_RELBIT, REL_Y);
+        ioctl(ufile, UI_SET_RELBIT, REL_WHEEL);
+        ioctl(ufile, UI_SET_RELBIT, REL_HWHEEL);
+#ifdef REL_WHEEL_HI_RES
+        ioctl(ufile, UI_SET_RELBIT, REL_WHEEL_HI_RES);
+        ioctl(ufile, UI_SET_RELBIT, REL_HWHEEL_HI_RES);
+#endif
+
+        return G13RegisterUinput(ufile, "G13 Pointer");
     }
 
     // *************************************************************************
 
+    // Queues an event for the next FlushEvents(). The timestamp is left empty since uinput stamps events itself
     void Device::SendEvent(const int type, const int code, const int val) {
-        memset(&device_event, 0, sizeof(device_event));
-        gettimeofday(&device_event.time, nullptr);
-        device_event.type = type;
-        device_event.code = code;
-        device_event.value = val;
-        IGUR(write(uinput_fid, &device_event, sizeof(device_event)));
+        if (event_batch_count == EVENT_BATCH_SIZE) {
+            FlushEvents();
+        }
+
+        input_event& event = event_batch[event_batch_count++];
+        event.type = type;
+        event.code = code;
+        event.value = val;
+    }
+
+    // Runs the action of a G13 key going down and remembers it, so that the same action releases the key
+    // even if the bindings change in the meantime
+    void Device::PressBinding(const int index, const std::shared_ptr<Action>& action) {
+        held_actions[index] = action;
+        held_bindings |= uint64_t{1} << index;
+        action->act(*this, true);
+    }
+
+    // Releases a G13 key through the action it was pressed with; does nothing if no action holds it
+    void Device::ReleaseBinding(const int index) {
+        if (!(held_bindings >> index & 1)) {
+            return;
+        }
+        held_bindings &= ~(uint64_t{1} << index);
+        const auto action = std::move(held_actions[index]);
+        action->act(*this, false);
+    }
+
+    uint64_t Device::HeldBindings() const {
+        return held_bindings;
+    }
+
+    // Presses a linux key on behalf of one binding. Only the first binding holding the key sends the event
+    void Device::PressKey(const int key) {
+        if (key < 0 || key >= KEY_CNT || key_press_counts[key] == UINT8_MAX) {
+            return;
+        }
+        if (key_press_counts[key]++ == 0) {
+            DBG("sending KEY DOWN " << key);
+            SendEvent(EV_KEY, key, 1);
+        }
+    }
+
+    // Releases a linux key on behalf of one binding. The key goes up once no other binding holds it
+    void Device::ReleaseKey(const int key) {
+        if (key < 0 || key >= KEY_CNT || key_press_counts[key] == 0) {
+            return;
+        }
+        if (--key_press_counts[key] == 0) {
+            DBG("sending KEY UP " << key);
+            SendEvent(EV_KEY, key, 0);
+        }
+    }
+
+    // Writes the queued events followed by one SYN_REPORT with a single writev(); does nothing if none are queued
+    void Device::FlushEvents() {
+        if (!event_batch_count) {
+            return;
+        }
+
+        static input_event syn_report = {{}, EV_SYN, SYN_REPORT, 0};
+        const iovec batch[] = {
+            {event_batch, event_batch_count * sizeof(input_event)},
+            {&syn_report, sizeof(syn_report)}
+        };
+        event_batch_count = 0;
+
+        IGUR(writev(uinput_fid, batch, std::size(batch)));
+    }
+
+    // Writes relative motion to the pointer device followed by one SYN_REPORT, in a single writev()
+    void Device::SendPointerEvents(const input_event* events, const size_t count) const {
+        if (!count || pointer_fid < 0) {
+            return;
+        }
+
+        static input_event syn_report = {{}, EV_SYN, SYN_REPORT, 0};
+        const iovec batch[] = {
+            {const_cast<input_event*>(events), count * sizeof(input_event)},
+            {&syn_report, sizeof(syn_report)}
+        };
+        IGUR(writev(pointer_fid, batch, std::size(batch)));
     }
 
     void Device::OutputPipeWrite(const std::string& out) const {
@@ -328,9 +873,14 @@ namespace G13 {
         // Add filename to files currently loading
         files_currently_loading.emplace_back(clean_filename);
 
+        // The whole file takes effect at once
+        bindings_held++;
+
         // Ensure filename is removed from files currently loading when function exits
         auto remove_filename = [this]() {
             files_currently_loading.pop_back();
+            bindings_held--;
+            PublishBindings();
         };
         struct ScopeGuard {
             std::function<void()> on_exit;
@@ -340,6 +890,14 @@ namespace G13 {
             }
         } guard{remove_filename};
 
+        // Snapshots made with --compile are applied as they are
+        if (ConfigSnapshot::IsSnapshot(clean_filename)) {
+            if (ConfigSnapshot snapshot; snapshot.Open(clean_filename)) {
+                snapshot.Apply(*this);
+            }
+            return;
+        }
+
         std::ifstream stream(clean_filename);
         if (!stream) {
             LOG(log4cpp::Priority::ERROR << strerror(errno));
@@ -348,74 +906,168 @@ namespace G13 {
 
         std::string line;
         while (std::getline(stream, line)) {
-            Command(line.c_str(), info);
+            Command(line, info);
         }
     }
 
+    // Called by the event loop whenever the input pipe is readable
     void Device::ReadCommandsFromPipe() {
-        // Check if data is available to read from the input pipe
-        if (IsDataAvailable(input_pipe_fid)) {
-            // Copy existing data from the input pipe FIFO buffer
-            const auto buffer_end = static_cast<int>(input_pipe_fifo.length());
-            char buffer[1024 * 1024];
-            memcpy(buffer, input_pipe_fifo.c_str(), buffer_end);
-
-            // Read new data from the input pipe
-            const int read_result = static_cast<int>(read(input_pipe_fid, buffer + buffer_end,
-                                                          sizeof(buffer) - buffer_end));
-            LOG(log4cpp::Priority::DEBUG << "read " << read_result << " characters");
-
-            // If read error occurs, return
-            if (read_result < 0) {
-                return;
-            }
+        if (input_pipe_buffer.full()) {
+            ERR("command too long, discarding " << input_pipe_buffer.size() << " bytes");
+            input_pipe_buffer.Clear();
+        }
 
-            // Process the buffer containing the read data
-            ProcessBuffer(buffer, buffer_end, read_result);
+        // Read new data from the input pipe straight behind whatever is left of the last read
+        const bool was_empty = input_pipe_buffer.empty();
+        const ssize_t read_result = input_pipe_buffer.Read(input_pipe_fid);
+        LOG(log4cpp::Priority::DEBUG << "read " << read_result << " characters");
+
+        // If read error occurs, return
+        if (read_result <= 0) {
+            return;
         }
+
+        // With --legacy_images, a bare 960 byte image written in one go to an idle pipe is shown as it is. Without it,
+        // text which happens to add up to 960 bytes would be taken for an image
+        char* buffer = input_pipe_buffer.data();
+        if (isLegacyImages() && was_empty && read_result == SCREEN_BUF_SIZE &&
+            memcmp(buffer, FRAME_MAGIC, sizeof(FRAME_MAGIC))) {
+            getScreenRef().Image(reinterpret_cast<unsigned char*>(buffer), SCREEN_BUF_SIZE);
+            input_pipe_buffer.Clear();
+            return;
+        }
+
+        // Process the complete messages and keep whatever is incomplete for the next read
+        input_pipe_buffer.Consume(ProcessBuffer(buffer, input_pipe_buffer.size()));
     }
 
-    bool Device::IsDataAvailable(const int fd) {
-        // Set up the file descriptor set for select()
-        fd_set set;
-        FD_ZERO(&set);
-        FD_SET(fd, &set);
+    // Handles every complete message in the buffer: plain text command lines, mixed with framed messages
+    // which start with FRAME_MAGIC. Messages from a control socket client are answered on that client.
+    // Returns the number of bytes consumed
+    size_t Device::ProcessBuffer(char* buffer, const size_t size, ControlClient* client) {
+        size_t begin = 0;
+        while (begin < size) {
+            if (buffer[begin] == FRAME_MAGIC[0]) {
+                const size_t consumed = ProcessFrame(buffer + begin, size - begin, client);
+                if (!consumed) {
+                    break;
+                }
+                begin += consumed;
+                continue;
+            }
 
-        // Set up the timeout for select()
-        timeval tv{};
-        tv.tv_sec = 0;
-        tv.tv_usec = 0;
+            // Text command, terminated by a newline or, as before, a bare carriage return. The newline of a CRLF
+            // pair then ends an empty line, which is skipped
+            const size_t available = size - begin;
+            auto line_end = static_cast<char*>(memchr(buffer + begin, '\n', available));
+            const size_t before_newline = line_end ? line_end - (buffer + begin) : available;
+            if (const auto return_end = static_cast<char*>(memchr(buffer + begin, '\r', before_newline))) {
+                line_end = return_end;
+            }
+            if (!line_end) {
+                break;
+            }
+            if (const std::string_view line(buffer + begin, line_end); !line.empty()) {
+                HandleCommand(line, client);
+            }
+            begin = line_end - buffer + 1;
+        }
+        return begin;
+    }
 
-        // Check if data is available to read
-        return select(fd + 1, &set, nullptr, nullptr, &tv) > 0;
+    // Skips a bad frame header and everything up to the next place FRAME_MAGIC could start, logging once
+    size_t Device::ResyncFrames(const char* buffer, const size_t size) {
+        const char* next = buffer + 1;
+        const char* const end = buffer + size;
+        while ((next = static_cast<const char*>(memchr(next, FRAME_MAGIC[0], end - next)))) {
+            if (next + 1 == end || next[1] == FRAME_MAGIC[1]) {
+                break;
+            }
+            next++;
+        }
+        const size_t skipped = next ? next - buffer : size;
+        ERR("Bad frame header, skipping " << skipped << " bytes");
+        return skipped;
     }
 
-    void Device::ProcessBuffer(char* buffer, int buffer_end, int read_result) {
-        // Check if the buffer contains an image
-        if (read_result + buffer_end == 960) {
-            // Assume the buffer contains an image and send it to the screen
-            getScreenRef().Image(reinterpret_cast<unsigned char*>(buffer), read_result + buffer_end);
+    // Handles one framed message (FRAME_HEADER_SIZE byte header followed by the payload) and returns its
+    // size, or 0 if it is not complete yet. After a bad header, the stream is resynced to the next FRAME_MAGIC
+    size_t Device::ProcessFrame(const char* buffer, const size_t size, ControlClient* client) {
+        if (size < FRAME_HEADER_SIZE) {
+            if (memcmp(buffer, FRAME_MAGIC, std::min(size, sizeof(FRAME_MAGIC)))) {
+                return ResyncFrames(buffer, size);
+            }
+            return 0;
         }
-        else {
-            // Process the buffer line by line
-            int buffer_begin = 0;
-            for (read_result += buffer_end; buffer_end < read_result; buffer_end++) {
-                if (buffer[buffer_end] == '\r' || buffer[buffer_end] == '\n') {
-                    if (buffer_end != buffer_begin) {
-                        buffer[buffer_end] = '\0';
-                        Command(buffer + buffer_begin, "command");
-                    }
-                    buffer_begin = buffer_end + 1;
+
+        const auto header = reinterpret_cast<const unsigned char*>(buffer);
+        const uint32_t length = header[4] | header[5] << 8 | header[6] << 16 | static_cast<uint32_t>(header[7]) << 24;
+        if (memcmp(buffer, FRAME_MAGIC, sizeof(FRAME_MAGIC)) || length > FRAME_MAX_PAYLOAD) {
+            return ResyncFrames(buffer, size);
+        }
+        if (size < FRAME_HEADER_SIZE + length) {
+            return 0;
+        }
+
+        const auto payload = header + FRAME_HEADER_SIZE;
+        try {
+            switch (header[2]) {
+            case FRAME_TEXT:
+                HandleCommand(std::string_view(buffer + FRAME_HEADER_SIZE, length), client);
+                // HandleCommand() already replied
+                return FRAME_HEADER_SIZE + length;
+
+            case FRAME_IMAGE:
+                getScreenRef().Image(payload, static_cast<int>(length));
+                break;
+
+            case FRAME_BLIT:
+                // column, first 8 pixel page, width in columns, number of pages, then the page bytes row by row
+                if (length < 4 || length != 4u + payload[2] * payload[3]) {
+                    throw CommandException("bad blit size");
                 }
+                getScreenRef().Blit(payload[0], payload[1], payload[2], payload[3], payload + 4);
+                break;
+
+            default:
+                throw CommandException("unknown frame type " + std::to_string(header[2]));
+            }
+            if (client) {
+                client->Reply("", nullptr);
+            }
+        }
+        catch (const std::exception& ex) {
+            ERR("frame failed : " << ex.what());
+            if (client) {
+                client->Reply("", ex.what());
             }
+        }
+        return FRAME_HEADER_SIZE + length;
+    }
 
-            // Clear the input pipe FIFO buffer
-            input_pipe_fifo.clear();
+    // Runs one command line from the pipe or from a control socket client. A client gets a reply for every
+    // command, carrying the "@<id>" the command started with, if any
+    void Device::HandleCommand(std::string_view line, ControlClient* client) {
+        if (!client) {
+            Command(line, "command");
+            return;
+        }
 
-            // If there is remaining data, store it in the input pipe FIFO buffer
-            if (read_result - buffer_begin < static_cast<int>(sizeof(buffer))) {
-                input_pipe_fifo = std::string(buffer + buffer_begin, read_result - buffer_begin);
-            }
+        std::string id;
+        line.remove_prefix(std::min(line.find_first_not_of(" \t"), line.size()));
+        if (line.starts_with('@')) {
+            const size_t id_end = std::min(line.find_first_of(" \t"), line.size());
+            id = line.substr(0, id_end);
+            line.remove_prefix(id_end);
+        }
+
+        try {
+            Execute(line, "socket");
+            client->Reply(id, nullptr);
+        }
+        catch (const std::exception& ex) {
+            ERR("command failed : " << ex.what());
+            client->Reply(id, ex.what());
         }
     }
 
@@ -451,6 +1103,41 @@ namespace G13 {
         current_profile = profile;
     }
 
+    // Rebinding a key while it is held down releases whatever its old action pressed right away, rather than
+    // once the key goes up
+    void Device::SetKeyAction(const Key& key, const std::shared_ptr<Action>& action) {
+        ReleaseBinding(key.index());
+        FlushEvents();
+        getCurrentProfileRef().SetKeyAction(key.index(), action);
+    }
+
+    // Hands the current profile's bindings to the input path. Whatever report is being processed right now
+    // finishes with the bindings it started with, the next one sees the new ones
+    void Device::PublishBindings() {
+        if (bindings_held) {
+            return;
+        }
+
+        std::lock_guard lock(bindings_mutex);
+        if (auto bindings = getCurrentProfileRef().bindings(); bindings != published_bindings) {
+            active_bindings.store(bindings.get());
+            if (published_bindings) {
+                retired_bindings.emplace_back(input_epoch.load(), std::move(published_bindings));
+            }
+            published_bindings = std::move(bindings);
+        }
+        ReclaimBindings();
+    }
+
+    // Frees retired bindings no report can still be using: those retired while no report was being
+    // processed (even epoch), and those whose report has finished since (epoch moved on)
+    void Device::ReclaimBindings() {
+        const uint64_t epoch = input_epoch.load();
+        std::erase_if(retired_bindings, [epoch](const auto& retired) {
+            return !(retired.first & 1) || retired.first != epoch;
+        });
+    }
+
     std::shared_ptr<Action> Device::MakeAction(const std::string& action) {
         if (action.empty()) {
             throw CommandException("empty action string");
@@ -484,288 +1171,328 @@ namespace G13 {
             ERR("Error when initializing screen endpoint: " << DescribeLibusbErrorCode(error));
         }
         else {
+            // The screen endpoint was just reset, so whatever we sent before is gone
+            getScreenRef().InvalidateFrame();
             getScreenRef().ScreenWrite(logo, sizeof(logo));
         }
     }
 
-    void Device::InitCommands() {
-        // Command to write a string to the screen
-        command_table["out"] = [this](const char* remainder) {
-            getScreenRef().WriteString(remainder);
-        };
+    // Command to write a string to the screen
+    void Device::CommandOut(std::string_view remainder) {
+        // Everything after the separating space is text, including further whitespace
+        if (remainder.starts_with(' ')) {
+            remainder.remove_prefix(1);
+        }
+        getScreenRef().WriteString(remainder);
+    }
 
-        // Command to set the cursor position on the screen
-        command_table["pos"] = [this](const char* remainder) {
-            char* endptr;
-            const int row = static_cast<int>(strtol(remainder, &endptr, 10));
-            const int col = static_cast<int>(strtol(endptr, &endptr, 10));
+    // Command to set the cursor position on the screen
+    void Device::CommandPos(std::string_view remainder) {
+        const int row = extract_and_advance_number<int>(remainder);
+        const int col = extract_and_advance_number<int>(remainder);
+        getScreenRef().WritePos(row, col);
+    }
 
-            if (*endptr != '\0') {
-                ERR("Bad pos : " << remainder);
-            }
-            else {
-                getScreenRef().WritePos(row, col);
-            }
-        };
+    // Command to bind a key or stick zone to an action
+    void Device::CommandBind(std::string_view remainder) {
+        const std::string keyname(extract_and_advance_token(remainder));
+        const std::string_view raw_action = left_trim(remainder);
+        std::string action(extract_and_advance_token(remainder));
+        const std::string_view action_up = extract_and_advance_token(remainder);
 
-        // Command to bind a key or stick zone to an action
-        command_table["bind"] = [this](const char* remainder) {
-            const std::string keyname = extract_and_advance_token(remainder);
-            const char* raw_action = left_trim(remainder);
-            std::string action = extract_and_advance_token(remainder);
-            const std::string action_up = extract_and_advance_token(remainder);
+        if (raw_action.starts_with('!') || raw_action.starts_with('>')) {
+            action = raw_action;
+        }
+        else if (!action_up.empty()) {
+            action += ' ';
+            action += action_up;
+        }
 
-            if (!action.empty() && strchr("!>", action[0])) {
-                action = std::string(raw_action);
+        try {
+            if (const auto key = getCurrentProfileRef().FindKey(keyname)) {
+                SetKeyAction(*key, MakeAction(action));
             }
-            else if (!action_up.empty()) {
-                action += std::string(" ") + action_up;
+            else if (const auto stick_key = getStickRef().zone(keyname)) {
+                getStickRef().SetZoneAction(*stick_key, MakeAction(action));
             }
-
-            try {
-                if (const auto key = getCurrentProfileRef().FindKey(keyname)) {
-                    key->set_action(MakeAction(action));
-                }
-                else if (const auto stick_key = getStickRef().zone(keyname)) {
-                    stick_key->set_action(MakeAction(action));
-                }
-                else {
-                    ERR("Bind key " << keyname << " unknown");
-                    return;
-                }
-                LOG(log4cpp::Priority::DEBUG << "Bind " << keyname << " [" << action << "]");
-            }
-            catch (const std::exception& ex) {
-                ERR("Bind " << keyname << " " << action << " failed : " << ex.what());
+            else {
+                throw CommandException("bind key " + keyname + " unknown");
             }
-        };
-
-        // Command to switch to a different profile
-        command_table["profile"] = [this](const char* remainder) {
-            const std::string profile = extract_and_advance_token(remainder);
-            SwitchToProfile(profile);
-        };
+            LOG(log4cpp::Priority::DEBUG << "Bind " << keyname << " [" << action << "]");
+        }
+        catch (const CommandException&) {
+            throw;
+        }
+        catch (const std::exception& ex) {
+            throw CommandException("bind " + keyname + " " + action + " failed : " + ex.what());
+        }
+    }
 
-        // Command to switch to a different font
-        command_table["font"] = [this](const char* remainder) {
-            const std::string font = extract_and_advance_token(remainder);
-            SwitchToFont(font);
-        };
+    // Command to switch to a different profile
+    void Device::CommandProfile(std::string_view remainder) {
+        SwitchToProfile(std::string(extract_and_advance_token(remainder)));
+    }
 
-        // Command to set the mode LEDs
-        command_table["mod"] = [this](const char* remainder) {
-            char* endptr;
-            const int leds = static_cast<int>(strtol(remainder, &endptr, 10));
+    // Command to switch to a different font
+    void Device::CommandFont(std::string_view remainder) {
+        SwitchToFont(std::string(extract_and_advance_token(remainder)));
+    }
 
-            if (*endptr != '\0') {
-                ERR("Bad mod format: <" << remainder << ">");
-            }
-            else {
-                SetModeLeds(leds);
-            }
-        };
+    // Command to set the mode LEDs
+    void Device::CommandMod(std::string_view remainder) {
+        SetModeLeds(extract_and_advance_number<int>(remainder));
+    }
 
-        // Command to set the text mode on the screen
-        command_table["textmode"] = [this](const char* remainder) {
-            char* endptr;
-            const int textmode = static_cast<int>(strtol(remainder, &endptr, 10));
+    // Command to set the text mode on the screen
+    void Device::CommandTextMode(std::string_view remainder) {
+        getScreenRef().setTextMode(extract_and_advance_number<int>(remainder));
+    }
 
-            if (*endptr != '\0') {
-                ERR("bad textmode format: <" << remainder << ">");
-            }
-            else {
-                getScreenRef().setTextMode(textmode);
-            }
-        };
+    // Command to set the RGB color of the keys
+    void Device::CommandRgb(std::string_view remainder) {
+        const int red = extract_and_advance_number<int>(remainder);
+        const int green = extract_and_advance_number<int>(remainder);
+        const int blue = extract_and_advance_number<int>(remainder);
+        SetKeyColor(red, green, blue);
+    }
 
-        // Command to set the RGB color of the keys
-        command_table["rgb"] = [this](const char* remainder) {
-            char* endptr;
-            const int red = static_cast<int>(strtol(remainder, &endptr, 10));
-            const int green = static_cast<int>(strtol(endptr, &endptr, 10));
-            const int blue = static_cast<int>(strtol(endptr, &endptr, 10));
+    // Command to set the stick mode
+    void Device::CommandStickMode(std::string_view remainder) {
+        const std::string_view mode = extract_and_advance_token(remainder);
 
-            if (*endptr != '\0') {
-                ERR("rgb bad format: <" << remainder << ">");
-            }
-            else {
-                SetKeyColor(red, green, blue);
-            }
+        constexpr std::string_view modes[] = {
+            "ABSOLUTE", "KEYS", "CALCENTER", "CALBOUNDS", "CALNORTH", "MOUSE", "SCROLL"
         };
-
-        // Command to set the stick mode
-        command_table["stickmode"] = [this](const char* remainder) {
-            const std::string mode = extract_and_advance_token(remainder);
-
-            const std::string modes[] = {"ABSOLUTE", "KEYS", "CALCENTER", "CALBOUNDS", "CALNORTH"};
-            int index = 0;
-            for (auto& test : modes) {
-                if (test == mode) {
-                    getStickRef().set_mode(static_cast<stick_mode_t>(index));
-                    return;
+        int index = 0;
+        for (auto& test : modes) {
+            if (test == mode) {
+                // MOUSE and SCROLL optionally take a deadzone, speed and acceleration curve
+                if ((index == STICK_MOUSE || index == STICK_SCROLL) && !left_trim(remainder).empty()) {
+                    StickMotion motion{};
+                    motion.deadzone = extract_and_advance_number<double>(remainder);
+                    motion.speed = extract_and_advance_number<double>(remainder);
+                    motion.curve = extract_and_advance_number<double>(remainder);
+                    getStickRef().set_motion(static_cast<stick_mode_t>(index), motion);
                 }
-                index++;
+                getStickRef().set_mode(static_cast<stick_mode_t>(index));
+                return;
             }
-            ERR("unknown stick mode : <" << mode << ">");
-        };
+            index++;
+        }
+        throw CommandException("unknown stick mode : <" + std::string(mode) + ">");
+    }
 
-        // Command to manage stick zones
-        command_table["stickzone"] = [this](const char* remainder) {
-            const std::string operation = extract_and_advance_token(remainder);
-            const std::string zonename = extract_and_advance_token(remainder);
+    // Command to manage stick zones
+    void Device::CommandStickZone(std::string_view remainder) {
+        const std::string_view operation = extract_and_advance_token(remainder);
+        if (operation == "smoothing") {
+            getStickRef().set_smoothing(extract_and_advance_number<double>(remainder));
+            return;
+        }
+        const std::string zonename(extract_and_advance_token(remainder));
 
-            if (operation == "add") {
-                getStickRef().zone(zonename, true);
+        if (operation == "add") {
+            getStickRef().zone(zonename, true);
+        }
+        else {
+            StickZone* zone = getStickRef().zone(zonename);
+            if (!zone) {
+                throw CommandException("Unknown stick zone");
             }
-            else {
-                StickZone* zone = getStickRef().zone(zonename);
-                if (!zone) {
-                    throw CommandException("Unknown stick zone");
-                }
-                if (operation == "action") {
-                    zone->set_action(MakeAction(remainder));
-                }
-                else if (operation == "bounds") {
-                    char* endptr;
-                    const double x1 = strtod(remainder, &endptr);
-                    const double y1 = strtod(endptr, &endptr);
-                    const double x2 = strtod(endptr, &endptr);
-                    const double y2 = strtod(endptr, nullptr);
-                    if (endptr == remainder) {
-                        throw CommandException("bad bounds format");
-                    }
-                    OUT("Setting bounds " << x1 << " " << y1 << " " << x2 << " " << y2);
-                    zone->set_bounds(ZoneBounds(x1, y1, x2, y2));
-                }
-                else if (operation == "del") {
-                    getStickRef().RemoveZone(*zone);
-                }
-                else {
-                    ERR("Unknown stickzone operation: <" << operation << ">");
-                }
+            if (operation == "action") {
+                getStickRef().SetZoneAction(*zone, MakeAction(std::string(left_trim(remainder))));
             }
-        };
-
-        // Command to dump the current state
-        command_table["dump"] = [this](const char* remainder) {
-            const std::string target = extract_and_advance_token(remainder);
-
-            if (target == "all") {
-                Dump(std::cout, 3);
+            else if (operation == "bounds") {
+                const auto x1 = extract_and_advance_number<double>(remainder);
+                const auto y1 = extract_and_advance_number<double>(remainder);
+                const auto x2 = extract_and_advance_number<double>(remainder);
+                const auto y2 = extract_and_advance_number<double>(remainder);
+                OUT("Setting bounds " << x1 << " " << y1 << " " << x2 << " " << y2);
+                zone->set_bounds(ZoneBounds(x1, y1, x2, y2));
             }
-            else if (target == "current") {
-                Dump(std::cout, 1);
+            else if (operation == "hysteresis") {
+                const auto enter_margin = extract_and_advance_number<double>(remainder);
+                const auto exit_margin = extract_and_advance_number<double>(remainder);
+                zone->set_hysteresis(enter_margin, exit_margin);
             }
-            else if (target == "summary") {
-                Dump(std::cout, 0);
+            else if (operation == "del") {
+                getStickRef().RemoveZone(*zone);
             }
             else {
-                ERR("Unknown dump target: <" << target << ">");
+                throw CommandException("unknown stickzone operation: <" + std::string(operation) + ">");
             }
-        };
+        }
+    }
 
-        // Command to set the log level
-        command_table["log_level"] = [this](const char* remainder) {
-            const std::string level = extract_and_advance_token(remainder);
-            SetLogLevel(level);
-        };
+    // Command to dump the current state
+    void Device::CommandDump(std::string_view remainder) {
+        const std::string_view target = extract_and_advance_token(remainder);
 
-        // Command to refresh the screen
-        command_table["refresh"] = [this](const char* remainder) {
-            getScreenRef().image_send();
-        };
+        if (target == "all") {
+            Dump(std::cout, 3);
+        }
+        else if (target == "current") {
+            Dump(std::cout, 1);
+        }
+        else if (target == "summary") {
+            Dump(std::cout, 0);
+        }
+        else {
+            throw CommandException("unknown dump target: <" + std::string(target) + ">");
+        }
+    }
 
-        // Command to clear the screen
-        command_table["clear"] = [this](const char* remainder) {
-            getScreenRef().image_clear();
-            getScreenRef().image_send();
-        };
+    // Command to set the log level
+    void Device::CommandLogLevel(std::string_view remainder) {
+        SetLogLevel(std::string(extract_and_advance_token(remainder)));
+    }
 
-        // Command to delete profiles, keys, or zones
-        command_table["delete"] = [this](const char* remainder) {
-            bool found = false;
+    // Command to refresh the screen
+    void Device::CommandRefresh(std::string_view remainder) {
+        getScreenRef().InvalidateFrame();
+        getScreenRef().image_send();
+    }
 
-            const std::string target = extract_and_advance_token(remainder);
-            const std::string glob_pattern = extract_and_advance_token(remainder);
+    // Command to show the current contents of the shared framebuffer
+    void Device::CommandPresent(std::string_view remainder) {
+        if (!framebuffer) {
+            throw CommandException("no framebuffer available");
+        }
+        getScreenRef().Present(framebuffer);
+    }
 
-            const std::regex regex_pattern(glob_to_regex(glob_pattern.c_str()));
+    // Command to clear the screen
+    void Device::CommandClear(std::string_view remainder) {
+        getScreenRef().image_clear();
+        getScreenRef().image_send();
+    }
 
-            if (target == "profile") {
-                for (auto& profile : FilteredProfileNames(regex_pattern)) {
-                    profiles.erase(profile);
-                    OUT("Profile " << profile << " deleted");
-                    found = true;
-                }
-            }
-            else if (target == "key") {
-                for (const auto& key : getCurrentProfileRef().FilteredKeyNames(regex_pattern)) {
-                    getCurrentProfileRef().FindKey(key)->set_action(nullptr);
-                    OUT("Key " << key << " unbound");
-                    found = true;
-                }
-            }
-            else if (target == "zone") {
-                for (auto& zone : getStickRef().FilteredZoneNames(regex_pattern)) {
-                    getStickRef().RemoveZone(*getStickRef().zone(zone));
-                    OUT("stickzone " << zone << " unbound");
-                    found = true;
-                }
+    // Command to delete profiles, keys, or zones
+    void Device::CommandDelete(std::string_view remainder) {
+        bool found = false;
+
+        const std::string_view target = extract_and_advance_token(remainder);
+        const std::string glob_pattern(extract_and_advance_token(remainder));
+
+        const std::regex regex_pattern(glob_to_regex(glob_pattern.c_str()));
+
+        if (target == "profile") {
+            for (auto& profile : FilteredProfileNames(regex_pattern)) {
+                profiles.erase(profile);
+                OUT("Profile " << profile << " deleted");
+                found = true;
             }
-            else {
-                ERR("Unknown delete target: <" << target << ">");
+        }
+        else if (target == "key") {
+            for (const auto& key : getCurrentProfileRef().FilteredKeyNames(regex_pattern)) {
+                SetKeyAction(*getCurrentProfileRef().FindKey(key), nullptr);
+                OUT("Key " << key << " unbound");
                 found = true;
             }
-            if (!found) {
-                OUT("No " << target << " name matches <" << glob_pattern << ">");
+        }
+        else if (target == "zone") {
+            for (auto& zone : getStickRef().FilteredZoneNames(regex_pattern)) {
+                getStickRef().RemoveZone(*getStickRef().zone(zone));
+                OUT("stickzone " << zone << " unbound");
+                found = true;
             }
-        };
-
-        // Command to load commands from a file
-        command_table["load"] = [this](const char* remainder) {
-            const std::string filename = extract_and_advance_token(remainder);
-            ReadCommandsFromFile(filename, std::string(1 + files_currently_loading.size(), '>').c_str());
-        };
+        }
+        else {
+            throw CommandException("unknown delete target: <" + std::string(target) + ">");
+        }
+        if (!found) {
+            OUT("No " << target << " name matches <" << glob_pattern << ">");
+        }
     }
 
-    void Device::Command(const char* str, const char* info) {
-        // Pointer to the remainder of the command string
-        const char* remainder = str;
+    // Command to load commands from a file
+    void Device::CommandLoad(std::string_view remainder) {
+        const std::string filename(extract_and_advance_token(remainder));
+        ReadCommandsFromFile(filename, std::string(1 + files_currently_loading.size(), '>').c_str());
+    }
 
+    // Runs a command and logs it if it fails
+    void Device::Command(const std::string_view str, const char* info) {
         try {
-            // Extract the command from the string
-            const std::string cmd = extract_and_advance_token(remainder);
+            Execute(str, info);
+        }
+        catch (const std::exception& ex) {
+            ERR("command failed : " << ex.what());
+        }
+    }
 
-            if (cmd.empty()) {
-                return;
-            }
+    // Runs a command, throwing a CommandException if it is unknown or fails
+    void Device::Execute(const std::string_view str, const char* info) {
+        // View of the remainder of the command string
+        std::string_view remainder = str;
 
-            // Find the command in the command table
-            const auto command_iter = command_table.find(cmd);
-            if (info) {
-                OUT(info << ": " << left_trim(str));
-            }
+        // Extract the command from the string
+        const std::string_view cmd = extract_and_advance_token(remainder);
 
-            if (command_iter == command_table.end()) {
-                ERR("unknown command : " << cmd);
-                return;
-            }
+        if (cmd.empty()) {
+            return;
+        }
 
-            // Get the command function
-            const COMMAND_FUNCTION& func = command_iter->second;
-            // Execute the command function with the remainder of the string
-            func(remainder);
+        // Find the command in the command table
+        const int index = FindCommandIndex(cmd);
+        if (info) {
+            OUT(info << ": " << left_trim(str));
         }
-        catch (const std::exception& ex) {
-            ERR("command failed : " << ex.what());
+
+        if (index < 0) {
+            throw CommandException("unknown command : " + std::string(cmd));
+        }
+
+        // Execute the command function with the remainder of the string, binding changes included
+        // even if it fails halfway
+        try {
+            RunCommand(index, remainder);
+        }
+        catch (...) {
+            PublishBindings();
+            throw;
+        }
+        PublishBindings();
+    }
+
+    // Index of a command in the command table, or -1 if there is no such command.
+    // One hash and at most one string compare
+    int Device::FindCommandIndex(const std::string_view name) {
+        const uint8_t index = CommandTable::slots[CommandHash(name, CommandTable::seed)];
+        if (index == UINT8_MAX || CommandTable::entries[index].name != name) {
+            return -1;
+        }
+        return index;
+    }
+
+    std::string_view Device::CommandName(const size_t index) {
+        return index < std::size(CommandTable::entries) ? CommandTable::entries[index].name : std::string_view();
+    }
+
+    // Changes whenever commands are added, removed or reordered, which invalidates compiled snapshots
+    uint32_t Device::CommandTableHash() {
+        return CommandTable::names_hash;
+    }
+
+    // Runs a command found by FindCommandIndex(), throwing a CommandException if it fails
+    void Device::RunCommand(const size_t index, const std::string_view remainder) {
+        if (index >= std::size(CommandTable::entries)) {
+            throw CommandException("bad command index " + std::to_string(index));
         }
+        (this->*CommandTable::entries[index].function)(remainder);
     }
 
     void Device::Dump(std::ostream& o, const int detail) {
         o << "G13 id=" << getDeviceIndex() << std::endl;
         o << "   input_pipe_name=" << formatter(input_pipe_name) << std::endl;
         o << "   output_pipe_name=" << formatter(output_pipe_name) << std::endl;
+        o << "   framebuffer_name=" << formatter(framebuffer_name) << std::endl;
+        o << "   control_socket_name=" << formatter(control_socket_name) << std::endl;
+        o << "   control_clients=" << control_socket.getClientCount() << std::endl;
+        o << "   calibration_name=" << formatter(calibration_name) << std::endl;
         o << "   current_profile=" << getCurrentProfileRef().name() << std::endl;
         o << "   current_font=" << getCurrentFontRef().name() << std::endl;
+        o << "   lcd_frames_skipped=" << getScreenRef().getSkippedFrames() << std::endl;
 
         if (detail > 0) {
             o << "STICK" << std::endl;
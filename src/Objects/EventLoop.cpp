@@ -0,0 +1,134 @@
+//
+// Created by Britt Yazel on 03-16-2025.
+//
+
+#include <cerrno>
+#include <cstring>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "Objects/EventLoop.hpp"
+#include "log.hpp"
+
+namespace G13 {
+    constexpr int MAX_EVENTS = 32;
+
+    EventLoop::EventLoop() : epoll_fid(epoll_create1(EPOLL_CLOEXEC)),
+                             post_fid(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+        if (epoll_fid < 0) {
+            ERR("Unable to create epoll instance: " << strerror(errno));
+        }
+        Watch(post_fid, EPOLLIN, [this](uint32_t) {
+            RunPosted();
+        });
+    }
+
+    EventLoop::~EventLoop() {
+        if (post_fid >= 0) {
+            close(post_fid);
+        }
+        if (epoll_fid >= 0) {
+            close(epoll_fid);
+        }
+    }
+
+    bool EventLoop::Watch(const int fd, const uint32_t events, FD_CALLBACK callback) {
+        if (fd < 0) {
+            return false;
+        }
+
+        epoll_event event{};
+        event.events = events;
+        event.data.fd = fd;
+
+        std::lock_guard lock(callbacks_mutex);
+        const int op = callbacks.contains(fd) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        if (epoll_ctl(epoll_fid, op, fd, &event) < 0) {
+            ERR("Unable to watch fd " << fd << ": " << strerror(errno));
+            return false;
+        }
+
+        callbacks[fd] = std::make_shared<FD_CALLBACK>(std::move(callback));
+        return true;
+    }
+
+    // Changes the events of an fd that is already watched, keeping its callback
+    bool EventLoop::Modify(const int fd, const uint32_t events) {
+        epoll_event event{};
+        event.events = events;
+        event.data.fd = fd;
+
+        std::lock_guard lock(callbacks_mutex);
+        if (!callbacks.contains(fd) || epoll_ctl(epoll_fid, EPOLL_CTL_MOD, fd, &event) < 0) {
+            return false;
+        }
+        return true;
+    }
+
+    void EventLoop::Unwatch(const int fd) {
+        std::lock_guard lock(callbacks_mutex);
+        if (callbacks.erase(fd)) {
+            epoll_ctl(epoll_fid, EPOLL_CTL_DEL, fd, nullptr);
+        }
+    }
+
+    // Runs callback on the thread running this loop, from its next RunOnce()
+    void EventLoop::Post(POSTED_CALLBACK callback) {
+        {
+            std::lock_guard lock(posted_mutex);
+            posted.push_back(std::move(callback));
+        }
+        constexpr uint64_t one = 1;
+        if (write(post_fid, &one, sizeof(one)) < 0) {
+            ERR("Unable to wake event loop: " << strerror(errno));
+        }
+    }
+
+    void EventLoop::RunPosted() {
+        uint64_t value;
+        if (read(post_fid, &value, sizeof(value)) < 0) {
+            return;
+        }
+
+        std::vector<POSTED_CALLBACK> callbacks;
+        {
+            std::lock_guard lock(posted_mutex);
+            callbacks.swap(posted);
+        }
+        for (const auto& callback : callbacks) {
+            callback();
+        }
+    }
+
+    // Waits for at most timeout_ms (-1 blocks) and dispatches every ready fd. Returns the number of
+    // events dispatched, or -1 on error
+    int EventLoop::RunOnce(const int timeout_ms) {
+        epoll_event events[MAX_EVENTS];
+
+        const int count = epoll_wait(epoll_fid, events, MAX_EVENTS, timeout_ms);
+        if (count < 0) {
+            if (errno != EINTR) {
+                ERR("epoll_wait failed: " << strerror(errno));
+                return -1;
+            }
+            return 0;
+        }
+
+        for (int i = 0; i < count; i++) {
+            // Keep the callback alive even if it unwatches its own fd
+            std::shared_ptr<FD_CALLBACK> callback;
+            {
+                std::lock_guard lock(callbacks_mutex);
+                // An earlier callback in this batch may have unwatched this fd
+                const auto iter = callbacks.find(events[i].data.fd);
+                if (iter == callbacks.end()) {
+                    continue;
+                }
+                callback = iter->second;
+            }
+            (*callback)(events[i].events);
+        }
+        return count;
+    }
+}
@@ -15,37 +15,32 @@ namespace G13 {
     //definitions
     LINUX_KEY_VALUE input_key_max;
 
-    //Constructors
-    Key::Key(Profile& mode, const std::string& name, const int index) : Actionable(mode, name),
-        _index(index), _should_parse(true) {}
+    // Filled once by InitKeynames() before any device thread starts and read-only afterwards,
+    // so the lookups below need no locking
+    std::map<KEY_INDEX, std::string> key_to_name;
+    std::map<std::string, KEY_INDEX> name_to_key;
+    std::map<LINUX_KEY_VALUE, std::string> input_key_to_name;
+    std::map<std::string, LINUX_KEY_VALUE> input_name_to_key;
 
-    Key::Key(Profile& mode, const Key& key) : Actionable(mode, key.name()), _index(key._index),
-                                                              _should_parse(key._should_parse) {
-        // TODO: do not invoke virtual member function from ctor
-        Actionable::set_action(key.action());
-    }
+    //Constructors
+    Key::Key(std::string name, const int index) : _name(std::move(name)), _index(index), _should_parse(true) {}
 
-    void Key::dump(std::ostream& o) const {
+    void Key::dump(std::ostream& o, const std::shared_ptr<Action>& action) const {
         o << FindG13KeyName(index()) << "(" << index() << ") : ";
-        if (action()) {
-            action()->dump(o);
+        if (action) {
+            action->dump(o);
         }
         else {
             o << "(no action)";
         }
     }
 
-    KEY_INDEX Key::index() const {
-        return _index.index;
+    const std::string& Key::name() const {
+        return _name;
     }
 
-    void Key::ParseKey(const unsigned char* byte, Device* g13) const {
-        // state = true if key is pressed
-        if (const bool state = byte[_index.offset] & _index.mask;
-            g13->updateKeyState(_index.index, state) && _action) {
-            // If the key state has changed and if we have an action, execute the action
-            _action->act(*g13, state);
-        }
+    KEY_INDEX Key::index() const {
+        return _index;
     }
 
     /*************************************************/
@@ -30,49 +30,59 @@ namespace G13 {
         if (key_down_up.size() > 1) {
             scan(key_down_up[1], _keys_up);
         }
-    }
-
-    KeyAction::~KeyAction() = default;
 
-    void KeyAction::act(Device& g13, const bool is_down) {
-        auto downkeys = std::vector(InputKeyMax(), false);
+        compile();
+    }
 
-        auto send_key = [&](const LINUX_KEY_VALUE key, const bool down) {
-            g13.SendEvent(EV_KEY, key, down);
-            downkeys[key] = down;
-            LOG(log4cpp::Priority::DEBUG << "sending KEY " << (down? "DOWN ": "UP ") << key);
+    // Turns _keys/_keys_up into the event sequences sent on key down and key up
+    void KeyAction::compile() {
+        auto emit = [](std::vector<input_event>& out, const LINUX_KEY_VALUE key, const bool down) {
+            input_event event{};
+            event.type = EV_KEY;
+            event.code = static_cast<uint16_t>(key);
+            event.value = down;
+            out.push_back(event);
         };
 
-        auto send_keys = [&](const std::vector<KeyState>& keys) {
+        auto send_keys = [&](std::vector<input_event>& out, const std::vector<KeyState>& keys) {
             for (auto& key : keys) {
-                if (key.is_down() && downkeys[key.key()]) {
-                    send_key(key.key(), false);
-                }
-                send_key(key.key(), key.is_down());
+                emit(out, key.key(), key.is_down());
             }
         };
 
-        auto release_keys = [&](const std::vector<KeyState>& keys) {
+        auto release_keys = [&](std::vector<input_event>& out, const std::vector<KeyState>& keys) {
             for (auto i = keys.size(); i--;) {
-                if (downkeys[keys[i].key()]) {
-                    send_key(keys[i].key(), false);
+                if (keys[i].is_down()) {
+                    emit(out, keys[i].key(), false);
                 }
             }
         };
 
-        if (is_down) {
-            send_keys(_keys);
-            if (!_keys_up.empty())
-                release_keys(_keys);
-        }
-        else if (_keys_up.empty()) {
-            for (auto& key : _keys)
-                downkeys[key.key()] = key.is_down();
-            release_keys(_keys);
+        _down_events.clear();
+        _up_events.clear();
+
+        send_keys(_down_events, _keys);
+        if (_keys_up.empty()) {
+            release_keys(_up_events, _keys);
         }
         else {
-            send_keys(_keys_up);
-            release_keys(_keys_up);
+            // Separate down and up sequences are each sent as a complete tap
+            release_keys(_down_events, _keys);
+            send_keys(_up_events, _keys_up);
+            release_keys(_up_events, _keys_up);
+        }
+    }
+
+    KeyAction::~KeyAction() = default;
+
+    void KeyAction::act(Device& g13, const bool is_down) {
+        for (const auto& event : is_down ? _down_events : _up_events) {
+            if (event.value) {
+                g13.PressKey(event.code);
+            }
+            else {
+                g13.ReleaseKey(event.code);
+            }
         }
     }
 
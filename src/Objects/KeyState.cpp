@@ -15,6 +15,6 @@ namespace G13 {
     }
 
     bool KeyState::is_down() const {
-        return _key;
+        return _down;
     }
 }
@@ -2,6 +2,7 @@
 // Created by khampf on 13-05-2020.
 //
 
+#include <bit>
 #include <cassert>
 
 #include "Objects/Key.hpp"
@@ -10,65 +11,162 @@
 #include "Objects/Profile.hpp"
 
 namespace G13 {
-    Profile::Profile(Device& keypad, std::string name_arg) :
-        _keypad(keypad), _name(std::move(name_arg)) {
-        _init_keys();
+    // Position of a key's action in actions, whether this layer binds it or not
+    size_t KeyBindings::slot(const int index) const {
+        return std::popcount(mask & ((uint64_t{1} << index) - 1));
+    }
+
+    // The action bound to a key by the topmost layer which binds it differently, null if the key is unbound
+    const std::shared_ptr<Action>& KeyBindings::action(const int index) const {
+        static const std::shared_ptr<Action> unbound;
+        for (auto layer = this; layer; layer = layer->base.get()) {
+            if (layer->mask >> index & 1) {
+                return layer->actions[layer->slot(index)];
+            }
+        }
+        return unbound;
     }
 
+    // Binds index to action, which may be null, in this layer. A binding the same as in base is not stored
+    void KeyBindings::assign(const int index, const std::shared_ptr<Action>& action) {
+        const uint64_t bit = uint64_t{1} << index;
+        const auto position = actions.begin() + static_cast<ptrdiff_t>(slot(index));
+        if (base && action == base->action(index)) {
+            if (mask & bit) {
+                actions.erase(position);
+                mask &= ~bit;
+            }
+        }
+        else if (mask & bit) {
+            *position = action;
+        }
+        else {
+            actions.insert(position, action);
+            mask |= bit;
+        }
+        bound = action ? bound | bit : bound & ~bit;
+    }
+
+    // *************************************************************************
+
+    Profile::Profile(Device& keypad, std::string name_arg) :
+        _keypad(keypad), _bindings(std::make_shared<KeyBindings>()), _owns_layer(true), _name(std::move(name_arg)) {}
+
+    // Shares the other profile's bindings, SetKeyAction() puts a layer on top of them before the first change
     Profile::Profile(const Profile& other, std::string name_arg) :
-        _keypad(other._keypad), _keys(other._keys), _name(std::move(name_arg)) {}
+        _keypad(other._keypad), _bindings(other._bindings), _owns_layer(false), _name(std::move(name_arg)) {}
 
 
-    void Profile::_init_keys() {
-        // create a Key entry for every key in KEY_STRINGS
-        int key_index = 0;
-        // std::string str = KEY_STRINGS[0];
+    const Profile::KeyTable& Profile::_key_table() {
+        static const KeyTable table = [] {
+            KeyTable keys;
 
-        for (auto symbol = KEY_STRINGS; *symbol; symbol++) {
-            _keys.emplace_back(Key(*this, *symbol, key_index));
-            key_index++;
-        }
-        assert(_keys.size() == NUM_KEYS);
+            // create a Key entry for every key in KEY_STRINGS
+            int key_index = 0;
+            for (auto symbol = KEY_STRINGS; *symbol; symbol++) {
+                keys.keys.push_back(Key(*symbol, key_index));
+                key_index++;
+            }
+            assert(keys.keys.size() == NUM_KEYS);
 
-        // now disable testing for keys in NON_PARSED_KEYS
-        for (auto symbol = NON_PARSED_KEYS; *symbol; symbol++) {
-            Key* key = FindKey(*symbol);
-            key->_should_parse = false;
-        }
+            // now disable testing for keys in NON_PARSED_KEYS
+            for (auto symbol = NON_PARSED_KEYS; *symbol; symbol++) {
+                for (auto& key : keys.keys) {
+                    if (key.name() == *symbol) {
+                        key._should_parse = false;
+                    }
+                }
+            }
+
+            for (const auto& key : keys.keys) {
+                if (key._should_parse) {
+                    keys.parse_mask |= uint64_t{1} << key.index();
+                }
+            }
+            return keys;
+        }();
+        return table;
     }
 
     void Profile::dump(std::ostream& o) const {
         o << "Profile " << formatter(name()) << std::endl;
-        for (auto& key : _keys) {
-            if (key.action()) {
-                o << "   ";
-                key.dump(o);
-                o << std::endl;
-            }
+        for (uint64_t bound = _bindings->bound; bound; bound &= bound - 1) {
+            const int index = std::countr_zero(bound);
+            o << "   ";
+            _key_table().keys[index].dump(o, action(index));
+            o << std::endl;
         }
     }
 
-    void Profile::ParseKeys(const unsigned char* buf) {
-        buf += 3;
-        for (auto& _key : _keys) {
-            if (_key._should_parse) {
-                _key.ParseKey(buf, &_keypad);
+    // Static so the device can pass the bindings it published, which may belong to a profile that has
+    // been switched away from or deleted in the meantime
+    void Profile::ParseKeys(Device& keypad, const KeyBindings& bindings, const unsigned char* buf) {
+        // Bytes 3 to 7 of the report hold one bit per key, in KEY_STRINGS order
+        const uint64_t states = static_cast<uint64_t>(buf[3]) | static_cast<uint64_t>(buf[4]) << 8 |
+            static_cast<uint64_t>(buf[5]) << 16 | static_cast<uint64_t>(buf[6]) << 24 |
+            static_cast<uint64_t>(buf[7]) << 32;
+
+        // Only visit the keys whose state changed since the previous report and which are either bound, or
+        // still held by the action they were pressed with under other bindings
+        uint64_t changed = keypad.UpdateKeyStates(states) & _key_table().parse_mask &
+            (bindings.bound | keypad.HeldBindings());
+        while (changed) {
+            const int index = std::countr_zero(changed);
+            changed &= changed - 1;
+
+            if (states >> index & 1) {
+                if (bindings.bound >> index & 1) {
+                    keypad.PressBinding(index, bindings.action(index));
+                }
+            }
+            else {
+                keypad.ReleaseBinding(index);
             }
         }
     }
 
-    Key* Profile::FindKey(const std::string& keyname) {
-        if (const auto key = FindG13KeyValue(keyname); static_cast<size_t>(key) < _keys.size()) {
-            return &_keys[key];
+    const Key* Profile::FindKey(const std::string& keyname) const {
+        if (const auto key = FindG13KeyValue(keyname); static_cast<size_t>(key) < _key_table().keys.size()) {
+            return &_key_table().keys[key];
         }
         return nullptr;
     }
 
+    const std::shared_ptr<Action>& Profile::action(const int index) const {
+        return _bindings->action(index);
+    }
+
+    std::shared_ptr<const KeyBindings> Profile::bindings() const {
+        return _bindings;
+    }
+
+    // Binds an action to a key, or unbinds it when action is null
+    void Profile::SetKeyAction(const int index, const std::shared_ptr<Action>& action) {
+        if (_bindings->action(index) == action) {
+            return;
+        }
+        if (!_owns_layer) {
+            // The bindings are still those of the profile this one was made from; they stay shared as the base
+            // of a layer which holds only this profile's changes
+            auto layer = std::make_shared<KeyBindings>();
+            layer->bound = _bindings->bound;
+            layer->base = std::move(_bindings);
+            _bindings = std::move(layer);
+            _owns_layer = true;
+        }
+        else if (_bindings.use_count() > 1) {
+            // Profiles made from this one, or the input path once the device published it, share the layer and
+            // get to keep it as it is. Only this layer is copied, not the ones below it
+            _bindings = std::make_shared<KeyBindings>(*_bindings);
+        }
+        _bindings->assign(index, action);
+    }
+
     std::vector<std::string> Profile::FilteredKeyNames(const std::regex& pattern, const bool all) const {
         std::vector<std::string> names;
 
-        for (auto& key : _keys)
-            if (all || key.action())
+        for (auto& key : _key_table().keys)
+            if (all || _bindings->bound >> key.index() & 1)
                 if (std::regex_match(key.name(), pattern))
                     names.emplace_back(key.name());
         return names;
@@ -7,22 +7,130 @@
 #include "Objects/Screen.hpp"
 #include "log.hpp"
 
+#include <algorithm>
 #include <fstream>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
 
 namespace G13 {
-    Screen::Screen(Device& keypad) : m_keypad(keypad), cursor_row(0), cursor_col(0), text_mode(0) {}
+    Screen::Screen(Device& keypad) : m_keypad(keypad), cursor_row(0), cursor_col(0), text_mode(0),
+                                     last_frame_valid(false), skipped_frames(0), lcd_transfer(nullptr),
+                                     transfer_in_flight(false), transfer_cancelled(false), frame_pending(false),
+                                     external_frame(nullptr), back_buffer_dirty(false), compositor_fid(-1),
+                                     compositor_armed(false) {
+        int fps = DEFAULT_LCD_FPS;
+        if (const std::string config_fps = getStringConfigValue("lcd_fps"); !config_fps.empty()) {
+            fps = std::clamp(std::atoi(config_fps.c_str()), 1, 1000);
+        }
+        frame_interval_ns = 1000000000L / fps;
+    }
+
+    Screen::~Screen() {
+        StopCompositor();
+        if (lcd_transfer) {
+            libusb_free_transfer(lcd_transfer);
+        }
+    }
 
     void Screen::setTextMode(const int new_text_mode) {
         text_mode = new_text_mode;
     }
 
+    unsigned long Screen::getSkippedFrames() const {
+        return skipped_frames;
+    }
+
     // Image handling
-    void Screen::Image(const unsigned char* data, const int size) const {
-        ScreenWrite(data, size);
+    void Screen::Image(const unsigned char* data, const int size) {
+        if (size != SCREEN_BUF_SIZE) {
+            ERR("Invalid image size " << size << ", should be " << SCREEN_BUF_SIZE);
+            return;
+        }
+        memcpy(image_buf, data, SCREEN_BUF_SIZE);
+        image_send();
+    }
+
+    // Marks the back buffer for the next compositor tick instead of sending it right away, so any number of
+    // draw commands between two ticks turn into a single, complete frame
+    void Screen::image_send() {
+        external_frame = nullptr;
+        back_buffer_dirty = true;
+        ArmCompositor();
+    }
+
+    // Makes the compositor read the next frames straight from a client-owned buffer (e.g. the shared
+    // framebuffer) instead of the back buffer, until something is drawn again. nullptr detaches it
+    void Screen::Present(const unsigned char* frame) {
+        external_frame = frame;
+        if (frame) {
+            back_buffer_dirty = true;
+            ArmCompositor();
+        }
     }
 
-    void Screen::image_send() const {
-        Image(image_buf, SCREEN_BUF_SIZE);
+    // Starts the compositor timer. Its first tick comes as soon as the event loop is idle again, later ones
+    // every frame_interval_ns for as long as there is something to draw
+    void Screen::ArmCompositor() {
+        if (compositor_armed) {
+            return;
+        }
+
+        if (compositor_fid < 0) {
+            compositor_fid = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+            if (compositor_fid < 0) {
+                ERR("Unable to create compositor timer: " << strerror(errno));
+                return;
+            }
+            m_keypad.getEventLoopRef().Watch(compositor_fid, EPOLLIN, [this](uint32_t) {
+                uint64_t expirations;
+                IGUR(read(compositor_fid, &expirations, sizeof(expirations)));
+                Composite();
+            });
+        }
+
+        itimerspec spec{};
+        spec.it_value.tv_nsec = 1;
+        spec.it_interval.tv_sec = frame_interval_ns / 1000000000L;
+        spec.it_interval.tv_nsec = frame_interval_ns % 1000000000L;
+        timerfd_settime(compositor_fid, 0, &spec, nullptr);
+        compositor_armed = true;
+    }
+
+    // Flips the back buffer to the device, or stops the timer if nothing was drawn since the last frame
+    void Screen::Composite() {
+        if (!back_buffer_dirty) {
+            constexpr itimerspec disarm{};
+            timerfd_settime(compositor_fid, 0, &disarm, nullptr);
+            compositor_armed = false;
+            return;
+        }
+
+        back_buffer_dirty = false;
+        ScreenWrite(external_frame ? external_frame : image_buf, SCREEN_BUF_SIZE);
+    }
+
+    void Screen::StopCompositor() {
+        if (compositor_fid >= 0) {
+            m_keypad.getEventLoopRef().Unwatch(compositor_fid);
+            close(compositor_fid);
+            compositor_fid = -1;
+        }
+        compositor_armed = false;
+    }
+
+    // Copies a width x pages block of LCD bytes (one byte is a column of 8 pixels) into the back buffer.
+    // page is the 8 pixel row the block starts on; data holds the bytes of each page one after the other
+    void Screen::Blit(const unsigned col, const unsigned page, const unsigned width, const unsigned pages,
+                      const unsigned char* data) {
+        if (col + width > SCREEN_COLUMNS || page + pages > SCREEN_ROWS / 8) {
+            throw CommandException("blit outside of the screen");
+        }
+
+        for (unsigned p = 0; p < pages; p++) {
+            memcpy(&image_buf[image_byte_offset((page + p) * 8, col)], data + p * width, width);
+        }
+        image_send();
     }
 
     void Screen::image_clear() {
@@ -59,16 +167,16 @@ namespace G13 {
         }
     }
 
-    void Screen::WriteString(const char* str) {
+    void Screen::WriteString(const std::string_view str) {
         OUT("writing \"" << str << "\"");
-        while (*str) {
-            if (*str == '\n') {
+        for (const char character : str) {
+            if (character == '\n') {
                 cursor_col = 0;
                 if (++cursor_row >= SCREEN_TEXT_ROWS) {
                     cursor_row = 0;
                 }
             }
-            else if (*str == '\t') {
+            else if (character == '\t') {
                 cursor_col += 4 - cursor_col % 4;
                 if (++cursor_col >= SCREEN_COLUMNS) {
                     cursor_col = 0;
@@ -78,9 +186,8 @@ namespace G13 {
                 }
             }
             else {
-                WriteChar(*str);
+                WriteChar(character);
             }
-            ++str;
         }
         image_send();
     }
@@ -97,29 +204,113 @@ namespace G13 {
     }
 
     // File handling
-    void Screen::ScreenWrite(const unsigned char* data, const size_t size) const {
+    // Forgets what the device is showing, so the next frame is sent even if it matches the last one
+    void Screen::InvalidateFrame() {
+        std::lock_guard lock(frame_mutex);
+        last_frame_valid = false;
+    }
+
+    void Screen::ScreenWrite(const unsigned char* data, const size_t size) {
         if (size != SCREEN_BUFFER_SIZE) {
             LOG(
                 log4cpp::Priority::ERROR << "Invalid screen data size " << size << ", should be " << SCREEN_BUFFER_SIZE);
             return;
         }
 
-        unsigned char buffer[SCREEN_BUFFER_SIZE + 32] = {};
-        buffer[0] = 0x03;
-        memcpy(buffer + 32, data, SCREEN_BUFFER_SIZE);
+        std::lock_guard lock(frame_mutex);
 
-        int transferred = 0;
-        const int error = libusb_interrupt_transfer(m_keypad.getHandlePtr(), LIBUSB_ENDPOINT_OUT | SCREEN_ENDPOINT,
-                                                    buffer, SCREEN_BUFFER_SIZE + 32, &transferred, 1000);
+        // The LCD already shows (or is about to show) this frame
+        if (last_frame_valid && !memcmp(last_frame, data, SCREEN_BUFFER_SIZE)) {
+            skipped_frames++;
+            return;
+        }
+        memcpy(last_frame, data, SCREEN_BUFFER_SIZE);
+        last_frame_valid = true;
 
-        if (error) {
-            LOG(
-                log4cpp::Priority::ERROR << "Error when transferring image: " << Device::DescribeLibusbErrorCode(
-                    error) << ", " << transferred << " bytes written");
+        // Only one transfer is in flight at a time. Anything newer waits in the pending slot, where it is
+        // overwritten by later frames, so a burst of updates collapses into its last frame
+        if (transfer_in_flight) {
+            if (frame_pending) {
+                skipped_frames++;
+            }
+            memcpy(pending_frame, data, SCREEN_BUFFER_SIZE);
+            frame_pending = true;
+            return;
+        }
+
+        SubmitFrame(data);
+    }
+
+    // Must be called with frame_mutex held
+    void Screen::SubmitFrame(const unsigned char* data) {
+        if (transfer_cancelled) {
+            return;
+        }
+
+        if (!lcd_transfer) {
+            lcd_transfer = libusb_alloc_transfer(0);
+            if (!lcd_transfer) {
+                ERR("Unable to allocate LCD transfer");
+                return;
+            }
+            const auto buffer = static_cast<unsigned char*>(malloc(SCREEN_BUFFER_SIZE + 32));
+            libusb_fill_interrupt_transfer(lcd_transfer, m_keypad.getHandlePtr(), LIBUSB_ENDPOINT_OUT | SCREEN_ENDPOINT,
+                                           buffer, SCREEN_BUFFER_SIZE + 32, FrameTransferCallback, this, 1000);
+            lcd_transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
         }
+
+        memset(lcd_transfer->buffer, 0, 32);
+        lcd_transfer->buffer[0] = 0x03;
+        memcpy(lcd_transfer->buffer + 32, data, SCREEN_BUFFER_SIZE);
+
+        if (const int error = libusb_submit_transfer(lcd_transfer); error != LIBUSB_SUCCESS) {
+            ERR("Error when transferring image: " << Device::DescribeLibusbErrorCode(error));
+            last_frame_valid = false;
+            return;
+        }
+        transfer_in_flight = true;
+    }
+
+    void LIBUSB_CALL Screen::FrameTransferCallback(libusb_transfer* transfer) {
+        const auto screen = static_cast<Screen*>(transfer->user_data);
+        std::lock_guard lock(screen->frame_mutex);
+        screen->transfer_in_flight = false;
+
+        switch (transfer->status) {
+        case LIBUSB_TRANSFER_COMPLETED:
+            break;
+        case LIBUSB_TRANSFER_CANCELLED:
+        case LIBUSB_TRANSFER_NO_DEVICE:
+            screen->frame_pending = false;
+            return;
+        default:
+            ERR("Error when transferring image: transfer status " << transfer->status << ", " <<
+                transfer->actual_length << " bytes written");
+            screen->last_frame_valid = false;
+            break;
+        }
+
+        if (screen->frame_pending) {
+            screen->frame_pending = false;
+            screen->SubmitFrame(screen->pending_frame);
+        }
+    }
+
+    void Screen::CancelTransfer() {
+        std::lock_guard lock(frame_mutex);
+        transfer_cancelled = true;
+        frame_pending = false;
+        if (transfer_in_flight) {
+            libusb_cancel_transfer(lcd_transfer);
+        }
+    }
+
+    bool Screen::HasPendingTransfer() {
+        std::lock_guard lock(frame_mutex);
+        return transfer_in_flight;
     }
 
-    void Screen::ScreenWriteFile(const std::string& filename) const {
+    void Screen::ScreenWriteFile(const std::string& filename) {
         std::ifstream filestr(filename, std::ios::binary);
         if (!filestr) {
             ERR("Failed to open file: " << filename);
@@ -2,17 +2,40 @@
 // Created by Britt Yazel on 03-16-2025.
 //
 
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <numbers>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
 #include <vector>
 #include <regex>
 
 #include "Objects/KeyAction.hpp"
+#include "exceptions.hpp"
 #include "log.hpp"
 #include "Objects/Stick.hpp"
 #include "Objects/StickZone.hpp"
 
 namespace G13 {
     Stick::Stick(Device& keypad) : _keypad(keypad), m_bounds(0, 0, 255, 255),
-                                               m_center_pos(127, 127), m_north_pos(127, 0) {
+                                               m_center_pos(127, 127), m_north_pos(127, 0),
+                                               m_saved_bounds(m_bounds), m_saved_center_pos(m_center_pos),
+                                               m_saved_north_pos(m_north_pos), m_sent_pos(-1, -1),
+                                               m_zone_table_valid(false), m_active_zones(0),
+                                               m_smoothing_weight(STICK_SMOOTHING_ONE), m_smoothed_valid(false),
+                                               m_smoothing_fid(-1), m_smoothing_armed(false), m_smoothing_ticks(0),
+                                               m_motion_table_valid(false), m_mouse_motion(DEFAULT_MOUSE_MOTION),
+                                               m_scroll_motion(DEFAULT_SCROLL_MOTION), m_motion_fid(-1),
+                                               m_motion_armed(false), m_motion_remainder(0, 0),
+                                               m_wheel_remainder(0, 0) {
+        RecalcCalibrated();
+
         m_stick_mode = STICK_KEYS;
 
         auto add_zone = [this, &keypad](const std::string& name, const double x1, const double y1, const double x2,
@@ -30,6 +53,11 @@ namespace G13 {
         add_zone("RIGHT", 0.7, 0.0, 1.0, 1.0);
     }
 
+    Stick::~Stick() {
+        StopSmoothing();
+        StopMotion();
+    }
+
     StickZone* Stick::zone(const std::string& name, const bool create) {
         for (auto& zone : m_zones) {
             if (zone.name() == name) {
@@ -37,6 +65,10 @@ namespace G13 {
             }
         }
         if (create) {
+            if (m_zones.size() == MAX_STICK_ZONES) {
+                throw CommandException("too many stick zones");
+            }
+            InvalidateZones();
             m_zones.emplace_back(*this, name, ZoneBounds(0.0, 0.0, 0.0, 0.0));
             return &m_zones.back();
         }
@@ -58,8 +90,26 @@ namespace G13 {
         if (m == m_stick_mode) {
             return;
         }
+        InvalidateZones();
+        DisarmMotion();
+        m_motion_table_valid = false;
         if (m_stick_mode == STICK_CALIB_CENTER || m_stick_mode == STICK_CALIB_BOUNDS || m_stick_mode == STICK_CALIB_NORTH) {
-            RecalcCalibrated();
+            if (CalibrationValid(m_bounds, m_center_pos, m_north_pos)) {
+                m_saved_bounds = m_bounds;
+                m_saved_center_pos = m_center_pos;
+                m_saved_north_pos = m_north_pos;
+                RecalcCalibrated();
+                _keypad.SaveCalibration();
+            }
+            else {
+                // The G13 only reports when the stick moves, so leaving a calibration mode without moving the
+                // stick is easy, and would leave it dead
+                ERR("Stick calibration incomplete, keeping the previous one");
+                m_bounds = m_saved_bounds;
+                m_center_pos = m_saved_center_pos;
+                m_north_pos = m_saved_north_pos;
+                RecalcCalibrated();
+            }
         }
         m_stick_mode = m;
         switch (m_stick_mode) {
@@ -71,17 +121,477 @@ namespace G13 {
         case STICK_KEYS:
         case STICK_CALIB_CENTER:
         case STICK_CALIB_NORTH:
+        case STICK_MOUSE:
+        case STICK_SCROLL:
             break;
         }
     }
 
-    void Stick::RecalcCalibrated() {}
+    // factor is how much of the previous position is kept on every report, from 0 (off) to just below 1
+    void Stick::set_smoothing(const double factor) {
+        if (factor < 0 || factor >= 1) {
+            throw CommandException("smoothing must be at least 0 and less than 1");
+        }
+        m_smoothing_weight = std::max(1, static_cast<int>(std::lround((1 - factor) * STICK_SMOOTHING_ONE)));
+        m_smoothed_valid = false;
+    }
+
+    void Stick::StopSmoothing() {
+        if (m_smoothing_fid >= 0) {
+            _keypad.getEventLoopRef().Unwatch(m_smoothing_fid);
+            close(m_smoothing_fid);
+            m_smoothing_fid = -1;
+        }
+        m_smoothing_armed = false;
+    }
+
+    void Stick::set_motion(const stick_mode_t mode, const StickMotion& motion) {
+        if (motion.deadzone < 0 || motion.deadzone >= 1 || motion.speed <= 0 || motion.curve <= 0) {
+            throw CommandException("stick motion needs a deadzone from 0 to below 1, and a positive speed and curve");
+        }
+        (mode == STICK_SCROLL ? m_scroll_motion : m_mouse_motion) = motion;
+        m_motion_table_valid = false;
+    }
+
+    void Stick::StopMotion() {
+        if (m_motion_fid >= 0) {
+            _keypad.getEventLoopRef().Unwatch(m_motion_fid);
+            close(m_motion_fid);
+            m_motion_fid = -1;
+        }
+        m_motion_armed = false;
+    }
+
+    // Each axis only depends on its own raw value, so one entry per raw x and per raw y covers every position
+    void Stick::BuildMotionTable() {
+        const StickMotion& motion = m_stick_mode == STICK_SCROLL ? m_scroll_motion : m_mouse_motion;
+        const double units = m_stick_mode == STICK_SCROLL ? WHEEL_HI_RES_DETENT : 1;
+
+        auto speed = [&](const int normalized) {
+            const double deflection = std::clamp(static_cast<double>(normalized) / STICK_FIXED_ONE, -1.0, 1.0);
+            const double magnitude = std::abs(deflection);
+            if (magnitude <= motion.deadzone) {
+                return 0;
+            }
+            const double curved = std::pow((magnitude - motion.deadzone) / (1 - motion.deadzone), motion.curve);
+            return static_cast<int>(std::lround(std::copysign(curved * motion.speed * units * 256 / STICK_MOTION_RATE,
+                                                              deflection)));
+        };
+
+        for (int raw = 0; raw < 256; raw++) {
+            m_motion_speed_x[raw] = speed(Deflection(StickCoord(raw, m_center_pos.y)).x);
+            m_motion_speed_y[raw] = speed(Deflection(StickCoord(m_center_pos.x, raw)).y);
+        }
+        m_motion_table_valid = true;
+    }
+
+    void Stick::ArmMotion() {
+        if (m_motion_fid < 0) {
+            m_motion_fid = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+            if (m_motion_fid < 0) {
+                ERR("Unable to create mouse timer: " << strerror(errno));
+                return;
+            }
+            _keypad.getEventLoopRef().Watch(m_motion_fid, EPOLLIN, [this](uint32_t) {
+                uint64_t expirations;
+                IGUR(read(m_motion_fid, &expirations, sizeof(expirations)));
+                MotionTick();
+            });
+        }
+
+        itimerspec spec{};
+        spec.it_value.tv_nsec = 1;
+        spec.it_interval.tv_nsec = 1000000000L / STICK_MOTION_RATE;
+        timerfd_settime(m_motion_fid, 0, &spec, nullptr);
+        m_motion_armed = true;
+    }
+
+    void Stick::DisarmMotion() {
+        if (m_motion_armed) {
+            constexpr itimerspec disarm{};
+            timerfd_settime(m_motion_fid, 0, &disarm, nullptr);
+            m_motion_armed = false;
+        }
+        m_motion_remainder = StickCoord(0, 0);
+        m_wheel_remainder = StickCoord(0, 0);
+    }
+
+    // Moves the pointer or the wheels by one tick's worth of the speed the stick is held at, or stops the
+    // timer once the stick is back in the deadzone. The tables work along the stick's own axes, the north
+    // calibration is applied to the resulting speed
+    void Stick::MotionTick() {
+        const StickCoord speed(m_motion_speed_x[m_current_pos.x], m_motion_speed_y[m_current_pos.y]);
+        if ((m_stick_mode != STICK_MOUSE && m_stick_mode != STICK_SCROLL) || (!speed.x && !speed.y)) {
+            DisarmMotion();
+            return;
+        }
+
+        const StickCoord rotated = Rotate(speed);
+        m_motion_remainder.x += rotated.x;
+        m_motion_remainder.y += rotated.y;
+        const int dx = m_motion_remainder.x >> 8;
+        const int dy = m_motion_remainder.y >> 8;
+        m_motion_remainder.x -= dx * 256;
+        m_motion_remainder.y -= dy * 256;
+
+        if (m_stick_mode == STICK_SCROLL) {
+            SendWheel(dx, -dy);
+            return;
+        }
+
+        input_event events[2]{};
+        size_t count = 0;
+        auto add = [&](const int code, const int value) {
+            if (value) {
+                events[count].type = EV_REL;
+                events[count].code = code;
+                events[count].value = value;
+                count++;
+            }
+        };
+        add(REL_X, dx);
+        add(REL_Y, dy);
+        _keypad.SendPointerEvents(events, count);
+    }
+
+    // Pushing the stick up scrolls up, which is a positive REL_WHEEL. Applications which only know classic
+    // wheels get a detent whenever a whole one has added up
+    void Stick::SendWheel(const int horizontal, const int vertical) {
+        input_event events[4]{};
+        size_t count = 0;
+        auto add = [&](const int code, const int value) {
+            if (value) {
+                events[count].type = EV_REL;
+                events[count].code = code;
+                events[count].value = value;
+                count++;
+            }
+        };
+#ifdef REL_WHEEL_HI_RES
+        add(REL_HWHEEL_HI_RES, horizontal);
+        add(REL_WHEEL_HI_RES, vertical);
+#endif
+        m_wheel_remainder.x += horizontal;
+        m_wheel_remainder.y += vertical;
+        if (const int detents = m_wheel_remainder.x / WHEEL_HI_RES_DETENT) {
+            add(REL_HWHEEL, detents);
+            m_wheel_remainder.x -= detents * WHEEL_HI_RES_DETENT;
+        }
+        if (const int detents = m_wheel_remainder.y / WHEEL_HI_RES_DETENT) {
+            add(REL_WHEEL, detents);
+            m_wheel_remainder.y -= detents * WHEEL_HI_RES_DETENT;
+        }
+        _keypad.SendPointerEvents(events, count);
+    }
+
+    // Turns the calibrated center, bounds and north into the factors Deflection() and Rotate() apply, so
+    // positions are only multiplied and shifted afterwards
+    void Stick::RecalcCalibrated() {
+        // An axis whose calibration makes no sense (nothing measured on one side of the center) stays centered
+        auto scale = [](const int span) {
+            return span > 0 ? STICK_FIXED_ONE / span : 0;
+        };
+        m_scale_low = StickCoord(scale(m_center_pos.x - m_bounds.tl.x), scale(m_center_pos.y - m_bounds.tl.y));
+        m_scale_high = StickCoord(scale(m_bounds.br.x - m_center_pos.x), scale(m_bounds.br.y - m_center_pos.y));
+
+        // Angle from the direction the stick was pushed during CALNORTH to straight up (-y)
+        double angle = 0;
+        if (m_north_pos.x != m_center_pos.x || m_north_pos.y != m_center_pos.y) {
+            angle = -std::numbers::pi / 2 - std::atan2(m_north_pos.y - m_center_pos.y, m_north_pos.x - m_center_pos.x);
+        }
+        m_north_cos = static_cast<int>(std::lround(std::cos(angle) * (1 << STICK_ROTATION_SHIFT)));
+        m_north_sin = static_cast<int>(std::lround(std::sin(angle) * (1 << STICK_ROTATION_SHIFT)));
+    }
+
+    // A calibration is usable if the center lies strictly inside the bounds and north points somewhere
+    bool Stick::CalibrationValid(const StickBounds& bounds, const StickCoord& center, const StickCoord& north) {
+        return bounds.tl.x < center.x && center.x < bounds.br.x && bounds.tl.y < center.y &&
+            center.y < bounds.br.y && (north.x != center.x || north.y != center.y);
+    }
+
+    // Restores calibration written by SaveCalibration(), returns false if there is none or it is unreadable
+    bool Stick::LoadCalibration(const std::string& filename) {
+        std::ifstream stream(filename);
+        if (!stream) {
+            return false;
+        }
+
+        StickBounds bounds = m_bounds;
+        StickCoord center = m_center_pos;
+        StickCoord north = m_north_pos;
+        std::string line;
+        while (std::getline(stream, line)) {
+            std::string_view remainder = line;
+            auto coordinate = [&remainder] {
+                const auto x = extract_and_advance_number<int>(remainder);
+                const auto y = extract_and_advance_number<int>(remainder);
+                if (x < 0 || x > 255 || y < 0 || y > 255) {
+                    throw CommandException("coordinate out of range");
+                }
+                return StickCoord(x, y);
+            };
+
+            try {
+                if (const std::string_view name = extract_and_advance_token(remainder); name == "center") {
+                    center = coordinate();
+                }
+                else if (name == "north") {
+                    north = coordinate();
+                }
+                else if (name == "bounds") {
+                    bounds.tl = coordinate();
+                    bounds.br = coordinate();
+                }
+                else if (!name.empty()) {
+                    throw CommandException("unknown entry " + std::string(name));
+                }
+            }
+            catch (const std::exception& ex) {
+                ERR("Ignoring stick calibration " << filename << ": " << ex.what());
+                return false;
+            }
+        }
+
+        if (!CalibrationValid(bounds, center, north)) {
+            ERR("Ignoring stick calibration " << filename << ": center is not inside the bounds or north is unset");
+            return false;
+        }
+
+        m_bounds = m_saved_bounds = bounds;
+        m_center_pos = m_saved_center_pos = center;
+        m_north_pos = m_saved_north_pos = north;
+        RecalcCalibrated();
+        InvalidateZones();
+        m_motion_table_valid = false;
+        return true;
+    }
+
+    bool Stick::SaveCalibration(const std::string& filename) const {
+        if (const std::filesystem::path dir_path = std::filesystem::path(filename).parent_path(); !dir_path.empty()) {
+            std::error_code error;
+            create_directories(dir_path, error);
+        }
+
+        // Write next to the target and rename, so an interrupted save never leaves half a file behind
+        const std::string temporary_filename = filename + ".tmp";
+        {
+            std::ofstream stream(temporary_filename, std::ios::trunc);
+            stream << "center " << m_center_pos.x << " " << m_center_pos.y << std::endl;
+            stream << "bounds " << m_bounds.tl.x << " " << m_bounds.tl.y << " " << m_bounds.br.x << " " <<
+                m_bounds.br.y << std::endl;
+            stream << "north " << m_north_pos.x << " " << m_north_pos.y << std::endl;
+            if (!stream) {
+                ERR("failed writing stick calibration " << temporary_filename);
+                remove(temporary_filename.c_str());
+                return false;
+            }
+        }
+        if (rename(temporary_filename.c_str(), filename.c_str()) < 0) {
+            ERR("failed saving stick calibration " << filename << ": " << strerror(errno));
+            remove(temporary_filename.c_str());
+            return false;
+        }
+        return true;
+    }
 
     void Stick::RemoveZone(const StickZone& zone) {
+        InvalidateZones();
         const StickZone& target(zone);
         std::erase(m_zones, target);
     }
 
+    // Rebinding a zone while the stick is in it releases whatever its old action pressed right away, like
+    // Device::SetKeyAction() does for keys. The next report enters the zone again with the new action
+    void Stick::SetZoneAction(StickZone& zone, const std::shared_ptr<Action>& action) {
+        if (const uint64_t bit = uint64_t{1} << (&zone - m_zones.data()); m_active_zones & bit) {
+            if (const auto& old_action = zone.action()) {
+                old_action->act(false);
+            }
+            m_active_zones &= ~bit;
+            _keypad.FlushEvents();
+        }
+        zone.set_action(action);
+    }
+
+    // Called whenever the calibration, the stick mode or the zones change. Zone bits are about to mean
+    // something else, so held zones are released; the next report presses whatever it is in again
+    void Stick::InvalidateZones() {
+        ReleaseZones();
+        m_zone_table_valid = false;
+        m_smoothed_valid = false;
+    }
+
+    // Runs outside of report processing, from commands and calibration loads, so nothing else would send
+    // the key ups before the next report
+    void Stick::ReleaseZones() {
+        if (!m_active_zones) {
+            return;
+        }
+        for (uint64_t active = m_active_zones; active; active &= active - 1) {
+            if (const auto& action = m_zones[std::countr_zero(active)].action()) {
+                action->act(false);
+            }
+        }
+        m_active_zones = 0;
+        _keypad.FlushEvents();
+    }
+
+    // Fixed point deflection from the calibrated center along the stick's own axes, STICK_FIXED_ONE at
+    // the calibrated bounds
+    StickCoord Stick::Deflection(const StickCoord& pos) const {
+        const int dx = pos.x - m_center_pos.x;
+        const int dy = pos.y - m_center_pos.y;
+        return {dx * (dx <= 0 ? m_scale_low.x : m_scale_high.x), dy * (dy <= 0 ? m_scale_low.y : m_scale_high.y)};
+    }
+
+    // Turns a vector along the stick's axes so the calibrated north points straight up
+    StickCoord Stick::Rotate(const StickCoord& vector) const {
+        const int64_t x = vector.x;
+        const int64_t y = vector.y;
+        return {static_cast<int>((x * m_north_cos - y * m_north_sin) >> STICK_ROTATION_SHIFT),
+                static_cast<int>((x * m_north_sin + y * m_north_cos) >> STICK_ROTATION_SHIFT)};
+    }
+
+    // Position relative to the calibrated bounds, center and north, from 0.0 (top/left) to 1.0 (bottom/right)
+    ZoneCoord Stick::Normalize(const StickCoord& pos) const {
+        const StickCoord deflection = Rotate(Deflection(pos));
+        return {0.5 + deflection.x / (2.0 * STICK_FIXED_ONE), 0.5 + deflection.y / (2.0 * STICK_FIXED_ONE)};
+    }
+
+    Stick::ZoneMasks Stick::ZoneMask(const StickCoord& pos) const {
+        const ZoneCoord jpos = Normalize(pos);
+        ZoneMasks masks{0, 0};
+        for (size_t index = 0; index < m_zones.size(); index++) {
+            if (m_zones[index].enter_bounds().contains(jpos)) {
+                masks.enter |= uint64_t{1} << index;
+            }
+            if (m_zones[index].exit_bounds().contains(jpos)) {
+                masks.stay |= uint64_t{1} << index;
+            }
+        }
+        return masks;
+    }
+
+    StickCoord Stick::Smooth(const StickCoord& raw) {
+        if (!m_smoothed_valid) {
+            m_smoothed_pos = StickCoord(raw.x << 8, raw.y << 8);
+            m_smoothed_valid = true;
+        }
+        else {
+            m_smoothed_pos.x += ((raw.x << 8) - m_smoothed_pos.x) * m_smoothing_weight / STICK_SMOOTHING_ONE;
+            m_smoothed_pos.y += ((raw.y << 8) - m_smoothed_pos.y) * m_smoothing_weight / STICK_SMOOTHING_ONE;
+        }
+        return {(m_smoothed_pos.x + 128) >> 8, (m_smoothed_pos.y + 128) >> 8};
+    }
+
+    // Starts stepping the smoothed position towards the stick's, or restarts the step count if it runs already
+    void Stick::ArmSmoothing() {
+        m_smoothing_ticks = 0;
+        if (m_smoothing_armed) {
+            return;
+        }
+
+        if (m_smoothing_fid < 0) {
+            m_smoothing_fid = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+            if (m_smoothing_fid < 0) {
+                ERR("Unable to create smoothing timer: " << strerror(errno));
+                return;
+            }
+            _keypad.getEventLoopRef().Watch(m_smoothing_fid, EPOLLIN, [this](uint32_t) {
+                uint64_t expirations;
+                IGUR(read(m_smoothing_fid, &expirations, sizeof(expirations)));
+                SmoothingTick();
+            });
+        }
+
+        itimerspec spec{};
+        spec.it_value.tv_nsec = 1000000000L / STICK_SMOOTHING_RATE;
+        spec.it_interval.tv_nsec = 1000000000L / STICK_SMOOTHING_RATE;
+        timerfd_settime(m_smoothing_fid, 0, &spec, nullptr);
+        m_smoothing_armed = true;
+    }
+
+    void Stick::DisarmSmoothing() {
+        if (m_smoothing_armed) {
+            constexpr itimerspec disarm{};
+            timerfd_settime(m_smoothing_fid, 0, &disarm, nullptr);
+            m_smoothing_armed = false;
+        }
+    }
+
+    // Takes one more smoothing step while the stick rests, so the zones end up where the stick is rather
+    // than wherever its last report left the average. Stops once the two agree, or snaps after a while
+    void Stick::SmoothingTick() {
+        if (m_stick_mode != STICK_KEYS || m_smoothing_weight == STICK_SMOOTHING_ONE) {
+            DisarmSmoothing();
+            return;
+        }
+
+        StickCoord pos = Smooth(m_current_pos);
+        if (++m_smoothing_ticks >= STICK_SMOOTHING_MAX_TICKS) {
+            m_smoothed_pos = StickCoord(m_current_pos.x << 8, m_current_pos.y << 8);
+            pos = m_current_pos;
+        }
+        if (pos.x == m_current_pos.x && pos.y == m_current_pos.y) {
+            DisarmSmoothing();
+        }
+        UpdateZones(pos);
+        _keypad.FlushEvents();
+    }
+
+    // Evaluates calibration and zones once for every raw position, so reports only need a lookup
+    void Stick::BuildZoneTable() {
+        m_zone_table.resize(STICK_ZONE_TABLE_SIZE);
+        m_zone_masks.clear();
+
+        for (int y = 0; y < 256; y++) {
+            for (int x = 0; x < 256; x++) {
+                const ZoneMasks mask = ZoneMask(StickCoord(x, y));
+
+                // Neighbouring positions mostly share their zones, so check the previous mask first
+                auto found = m_zone_masks.rbegin();
+                if (found == m_zone_masks.rend() || *found != mask) {
+                    found = std::find(m_zone_masks.rbegin(), m_zone_masks.rend(), mask);
+                }
+                if (found == m_zone_masks.rend()) {
+                    if (m_zone_masks.size() > UINT8_MAX) {
+                        DBG("Stick zones overlap too much for a lookup table");
+                        m_zone_table.clear();
+                        m_zone_table_valid = true;
+                        return;
+                    }
+                    m_zone_masks.push_back(mask);
+                    found = m_zone_masks.rbegin();
+                }
+                m_zone_table[y << 8 | x] = static_cast<uint8_t>(m_zone_masks.rend() - found - 1);
+            }
+        }
+        m_zone_table_valid = true;
+    }
+
+    // Presses the zones pos entered and releases the ones it left
+    void Stick::UpdateZones(const StickCoord& pos) {
+        if (!m_zone_table_valid) {
+            BuildZoneTable();
+        }
+        const ZoneMasks masks = m_zone_table.empty()
+                                    ? ZoneMask(pos)
+                                    : m_zone_masks[m_zone_table[pos.y << 8 | pos.x]];
+        const uint64_t active = masks.enter | (m_active_zones & masks.stay);
+
+        // Only zones which were entered or left since the previous position do anything
+        uint64_t changed = active ^ m_active_zones;
+        m_active_zones = active;
+        while (changed) {
+            const int index = std::countr_zero(changed);
+            changed &= changed - 1;
+
+            if (const auto& action = m_zones[index].action()) {
+                action->act(active >> index & 1);
+            }
+        }
+    }
+
     void Stick::dump(std::ostream& out) const {
         for (auto& zone : m_zones) {
             zone.dump(out);
@@ -109,46 +619,41 @@ namespace G13 {
 
         case STICK_ABSOLUTE:
         case STICK_KEYS:
+        case STICK_MOUSE:
+        case STICK_SCROLL:
             break;
         }
 
-        // determine our normalized position
-        double dx; // = 0.5
-        if (m_current_pos.x <= m_center_pos.x) {
-            dx = m_current_pos.x - m_bounds.tl.x;
-            dx /= (m_center_pos.x - m_bounds.tl.x) * 2;
-        }
-        else {
-            dx = m_bounds.br.x - m_current_pos.x;
-            dx /= (m_bounds.br.x - m_center_pos.x) * 2;
-            dx = 1.0 - dx;
-        }
-        double dy; // = 0.5;
-        if (m_current_pos.y <= m_center_pos.y) {
-            dy = m_current_pos.y - m_bounds.tl.y;
-            dy /= (m_center_pos.y - m_bounds.tl.y) * 2;
-        }
-        else {
-            dy = m_bounds.br.y - m_current_pos.y;
-            dy /= (m_bounds.br.y - m_center_pos.y) * 2;
-            dy = 1.0 - dy;
-        }
-
-        DBG("x=" << m_current_pos.x << " y=" << m_current_pos.y << " dx=" << dx << " dy=" << dy);
-        const ZoneCoord jpos(dx, dy);
-
         if (m_stick_mode == STICK_ABSOLUTE) {
-            _keypad.SendEvent(EV_ABS, ABS_X, m_current_pos.x);
-            _keypad.SendEvent(EV_ABS, ABS_Y, m_current_pos.y);
+            // Only report axes which moved, so an idle stick produces no events at all
+            if (m_current_pos.x != m_sent_pos.x) {
+                _keypad.SendEvent(EV_ABS, ABS_X, m_current_pos.x);
+            }
+            if (m_current_pos.y != m_sent_pos.y) {
+                _keypad.SendEvent(EV_ABS, ABS_Y, m_current_pos.y);
+            }
+            m_sent_pos = m_current_pos;
         }
         else if (m_stick_mode == STICK_KEYS) {
-            for (auto& zone : m_zones) {
-                zone.test(jpos);
+            if (m_smoothing_weight < STICK_SMOOTHING_ONE) {
+                const StickCoord pos = Smooth(m_current_pos);
+                if (pos.x != m_current_pos.x || pos.y != m_current_pos.y) {
+                    ArmSmoothing();
+                }
+                UpdateZones(pos);
+            }
+            else {
+                UpdateZones(m_current_pos);
             }
         }
-        else {
-            /*    send_event(g13->uinput_file, EV_REL, REL_X, stick_x/16 - 8);
-             SendEvent(g13->uinput_file, EV_REL, REL_Y, stick_y/16 - 8);*/
+        else if (m_stick_mode == STICK_MOUSE || m_stick_mode == STICK_SCROLL) {
+            if (!m_motion_table_valid) {
+                BuildMotionTable();
+            }
+            // The timer does the rest, and stops itself once the stick is centered again
+            if (!m_motion_armed && (m_motion_speed_x[m_current_pos.x] || m_motion_speed_y[m_current_pos.y])) {
+                ArmMotion();
+            }
         }
     }
 }
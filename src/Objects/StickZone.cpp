@@ -6,16 +6,20 @@
 
 #include "Objects/Action.hpp"
 #include "Objects/StickZone.hpp"
+#include "exceptions.hpp"
 
 namespace G13 {
     StickZone::StickZone(Stick& stick, const std::string& name, const ZoneBounds& b,
                                  const std::shared_ptr<Action>& action) :
-        Actionable(stick, name), _bounds(b), _active(false) {
+        Actionable(stick, name), _bounds(b), _enter_margin(0), _exit_margin(0) {
         Actionable::set_action(action); // Call to virtual from ctor!
     }
 
     void StickZone::dump(std::ostream& out) const {
         out << "   " << std::setw(20) << name() << "   " << _bounds << "  ";
+        if (_enter_margin != 0 || _exit_margin != 0) {
+            out << "hysteresis " << _enter_margin << " / " << _exit_margin << "  ";
+        }
         if (action()) {
             action()->dump(out);
         }
@@ -24,22 +28,38 @@ namespace G13 {
         }
     }
 
-    void StickZone::test(const ZoneCoord& loc) {
-        if (!_action)
-            return;
-        const bool prior_active = _active;
-        _active = _bounds.contains(loc);
-        if (!_active) {
-            if (prior_active) {
-                _action->act(false);
-            }
-        }
-        else {
-            _action->act(true);
-        }
+    const ZoneBounds& StickZone::bounds() const {
+        return _bounds;
+    }
+
+    // Edges on the rim of the stick's travel keep their place: the stick can't get any further than those,
+    // so a zone reaching the rim would never be entered at full deflection otherwise
+    ZoneBounds StickZone::enter_bounds() const {
+        auto low = [this](const double edge) {
+            return edge <= 0.0 ? edge : edge + _enter_margin;
+        };
+        auto high = [this](const double edge) {
+            return edge >= 1.0 ? edge : edge - _enter_margin;
+        };
+        return {low(_bounds.tl.x), low(_bounds.tl.y), high(_bounds.br.x), high(_bounds.br.y)};
+    }
+
+    ZoneBounds StickZone::exit_bounds() const {
+        return {_bounds.tl.x - _exit_margin, _bounds.tl.y - _exit_margin,
+                _bounds.br.x + _exit_margin, _bounds.br.y + _exit_margin};
     }
 
     void StickZone::set_bounds(const ZoneBounds& bounds) {
         _bounds = bounds;
+        parent().InvalidateZones();
+    }
+
+    void StickZone::set_hysteresis(const double enter_margin, const double exit_margin) {
+        if (enter_margin < 0 || exit_margin < 0) {
+            throw CommandException("hysteresis margins can't be negative");
+        }
+        _enter_margin = enter_margin;
+        _exit_margin = exit_margin;
+        parent().InvalidateZones();
     }
 }
@@ -0,0 +1,59 @@
+//
+// Created by Britt Yazel on 03-16-2025.
+//
+
+#include <cstring>
+#include <unistd.h>
+
+#include "Utils/InputBuffer.hpp"
+
+namespace G13 {
+    InputBuffer::InputBuffer(const size_t capacity) : storage(std::make_unique_for_overwrite<char[]>(capacity)),
+                                                      capacity(capacity), head(0), tail(0) {}
+
+    // Reads whatever fits into the free space. Returns the result of read(), or 0 without reading if full()
+    ssize_t InputBuffer::Read(const int fd) {
+        if (tail == capacity && head > 0) {
+            memmove(storage.get(), storage.get() + head, tail - head);
+            tail -= head;
+            head = 0;
+        }
+        if (tail == capacity) {
+            return 0;
+        }
+
+        const ssize_t read_result = read(fd, storage.get() + tail, capacity - tail);
+        if (read_result > 0) {
+            tail += read_result;
+        }
+        return read_result;
+    }
+
+    void InputBuffer::Consume(const size_t count) {
+        head += count;
+        if (head >= tail) {
+            Clear();
+        }
+    }
+
+    void InputBuffer::Clear() {
+        head = 0;
+        tail = 0;
+    }
+
+    char* InputBuffer::data() const {
+        return storage.get() + head;
+    }
+
+    size_t InputBuffer::size() const {
+        return tail - head;
+    }
+
+    bool InputBuffer::empty() const {
+        return head == tail;
+    }
+
+    bool InputBuffer::full() const {
+        return tail - head == capacity;
+    }
+}
@@ -2,6 +2,7 @@
 // Created by Britt Yazel on 03-16-2025.
 //
 
+#include <algorithm>
 #include <cstring>
 #include <iomanip>
 #include <functional>
@@ -28,44 +29,46 @@ namespace G13 {
     * @brief Trims leading spaces and tabs from a string.
     *
     * This function skips over any leading spaces and tabs in the input string
-    * and returns a pointer to the first non-whitespace character.
+    * and returns the rest of it.
     *
     * @param string The input string to be trimmed.
-    * @return A pointer to the first non-whitespace character in the input string.
+    * @return The input string without its leading whitespace.
     */
-    const char* left_trim(const char* string) {
-        // Skip over leading spaces and tabs
-        while (*string == ' ' || *string == '\t') {
-            ++string;
-        }
-        // Return pointer to the first non-whitespace character
-        return string;
+    std::string_view left_trim(const std::string_view string) {
+        return string.substr(std::min(string.find_first_not_of(" \t"), string.size()));
     }
 
     /**
-     * @brief Extracts the next token from the source string and advances the source pointer.
+     * @brief Extracts the next token from the source string and advances the source past it.
      *
-     * This function trims leading whitespace from the source string, extracts the next token
-     * (delimited by whitespace or a hash character), and advances the source pointer past the token.
+     * This function skips leading whitespace, then extracts the next token, which ends at whitespace
+     * or at a '#' starting a comment. A token starting with a double or single quote runs up to the
+     * matching quote instead, and may contain whitespace and '#'. A comment consumes the rest of the
+     * source. The token is a view into the source, so nothing is copied or allocated.
      *
-     * @param source A reference to the source string pointer. The pointer will be advanced past the extracted token.
-     * @return The extracted token.
+     * @param source A reference to the source string. It will be advanced past the extracted token.
+     * @return The extracted token, without quotes; empty once the source is exhausted.
+     * @throws CommandException if a quoted token is not terminated.
      */
-    std::string extract_and_advance_token(const char*& source) {
-        std::istringstream stream(source);
-        std::string token;
-        char delimiter;
-
-        // Extract the next token delimited by whitespace or a hash character
-        while (stream.get(delimiter)) {
-            if (delimiter == ' ' || delimiter == '#') {
-                break;
+    std::string_view extract_and_advance_token(std::string_view& source) {
+        source = left_trim(source);
+
+        if (source.starts_with('"') || source.starts_with('\'')) {
+            const size_t closing = source.find(source.front(), 1);
+            if (closing == std::string_view::npos) {
+                throw CommandException("unterminated quote");
             }
-            token += delimiter;
+            const std::string_view token = source.substr(1, closing - 1);
+            source.remove_prefix(closing + 1);
+            return token;
         }
 
-        // Update the source pointer to the remaining string
-        source += stream.tellg();
+        const size_t token_end = std::min(source.find_first_of(" \t#"), source.size());
+        const std::string_view token = source.substr(0, token_end);
+        source.remove_prefix(token_end);
+        if (source.starts_with('#')) {
+            source = {};
+        }
         return token;
     }
 
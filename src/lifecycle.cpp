@@ -2,9 +2,19 @@
 // Created by Britt Yazel on 03-16-2025.
 //
 
+#include <algorithm>
+#include <filesystem>
+#include <map>
 #include <memory>
+#include <ranges>
+#include <set>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
 #include <systemd/sd-bus.h>
 
+#include "Objects/ConfigSnapshot.hpp"
 #include "Objects/Device.hpp"
 #include "lifecycle.hpp"
 #include "log.hpp"
@@ -14,7 +24,19 @@
 namespace G13 {
 
     // Declarations
-    bool suspended = false;
+    std::atomic<bool> suspended = false;
+
+    // Devices which have been cleaned up but still wait for their cancelled transfers to come back
+    std::vector<Device*> retired_g13s = {};
+
+    // Cancelled transfers normally come back within one event round, so this limit only matters if libusb hangs
+    constexpr int RETIRE_WAIT_ATTEMPTS = 100;
+
+    // Devices which have been opened, from a hotplug callback for instance, but not set up yet
+    std::vector<Device*> new_g13s = {};
+
+    // The --config file, compiled once and replayed on every device that is set up
+    std::unique_ptr<ConfigSnapshot> config_program = std::make_unique<ConfigSnapshot>();
 
     void DiscoverG13s(libusb_device** devs, const ssize_t count) {
         for (int i = 0; i < count; i++) {
@@ -25,9 +47,6 @@ namespace G13 {
             }
             if (desc.idVendor == VENDOR_ID && desc.idProduct == PRODUCT_ID) {
                 OpenAndAddG13(devs[i]);
-                for (const auto g13 : g13s) {
-                    SetupDevice(g13);
-                }
             }
         }
     }
@@ -56,14 +75,39 @@ namespace G13 {
         }
 
         DBG("Interface successfully claimed");
+        std::lock_guard lock(g13s_mutex);
         const auto g13 = new Device(dev, usb_context, usb_handle, static_cast<int>(g13s.size()));
         g13s.push_back(g13);
+        new_g13s.push_back(g13);
         return 0;
     }
 
+    // Compiles the --config file into config_program. Done once, however many devices there are
+    void LoadConfig() {
+        if (const std::string config_filename = getStringConfigValue("config"); !config_filename.empty()) {
+            OUT("Reading configuration from: " << config_filename);
+            config_program->Load(config_filename);
+        }
+    }
+
+    // Sets up every device opened since the last call. Runs from the main loop rather than from the hotplug
+    // callbacks, since setting up does synchronous USB transfers
+    void SetupNewDevices() {
+        std::lock_guard lock(g13s_mutex);
+        for (const auto g13 : new_g13s) {
+            SetupDevice(g13);
+        }
+        new_g13s.clear();
+    }
+
     void SetupDevice(Device* g13) {
         OUT("Setting up device" << " " << g13->getDeviceIndex());
+
+        // Setup touches the whole device, so its own thread must not run in the meantime
+        g13->StopThread();
         g13->RegisterContext(usb_context);
+        g13->StartInputTransfers();
+        g13->LoadCalibration();
         if (!logoFilename.empty()) {
             g13->getScreenRef().ScreenWriteFile(logoFilename);
         }
@@ -71,19 +115,24 @@ namespace G13 {
         OUT("Active Stick Zones:");
         g13->getStickRef().dump(std::cout);
 
-        if (const std::string config_filename = getStringConfigValue("config"); !config_filename.empty()) {
-            OUT("Reading configuration from: " << config_filename);
-            g13->ReadCommandsFromFile(config_filename, "  cfg");
+        if (!config_program->empty()) {
+            config_program->Apply(*g13);
+        }
+
+        if (isThreaded()) {
+            g13->StartThread();
         }
     }
 
     // Cleanup all devices or only the one specified
     void CleanupDevices(const libusb_device* dev) {
+        std::lock_guard lock(g13s_mutex);
         for (auto iter = g13s.begin(); iter != g13s.end();) {
             if (!dev || dev == (*iter)->getDevicePtr()) {
                 OUT("Closing device " << std::distance(g13s.begin(), iter));
+                std::erase(new_g13s, *iter);
                 (*iter)->Cleanup();
-                delete *iter;
+                retired_g13s.push_back(*iter);
                 iter = g13s.erase(iter);
             }
             else {
@@ -92,6 +141,36 @@ namespace G13 {
         }
     }
 
+    // Delete retired devices once libusb has handed back all of their transfers. If wait is set, keep handling
+    // events until the cancelled transfers come back so that everything is released before libusb_exit()
+    void ReapRetiredDevices(const bool wait) {
+        for (int attempts = 0; wait && attempts < RETIRE_WAIT_ATTEMPTS; attempts++) {
+            const bool busy = std::ranges::any_of(retired_g13s, [](Device* g13) {
+                return g13->HasPendingTransfers();
+            });
+            if (!busy) {
+                break;
+            }
+            timeval tv = {0, 100000};
+            libusb_handle_events_timeout_completed(usb_context, &tv, nullptr);
+        }
+
+        for (auto iter = retired_g13s.begin(); iter != retired_g13s.end();) {
+            if (!(*iter)->HasPendingTransfers()) {
+                delete *iter;
+                iter = retired_g13s.erase(iter);
+            }
+            else if (wait) {
+                // Freeing a transfer which is still in flight is undefined, leaking the device is not
+                ERR("Device " << (*iter)->getDeviceIndex() << " still has transfers in flight, leaking it");
+                iter = retired_g13s.erase(iter);
+            }
+            else {
+                ++iter;
+            }
+        }
+    }
+
     // Reinitialize all devices or only the one specified
     int InitializeDevices(libusb_device* dev) {
         if (dev) {
@@ -119,21 +198,23 @@ namespace G13 {
 
 
     // ************************************************************************* //
-    // **************************** Systemd Thread ***************************** //
+    // **************************** Systemd Monitor **************************** //
     // ************************************************************************* //
 
+    sd_bus* suspend_bus = nullptr;
+
     // Monitor system suspend/resume events using libsystemd
-    // This runs in a separate thread started in Run()
+    // The bus fd is serviced by the main event loop, so the callback runs on the same thread as everything else
     void MonitorSuspendResume() {
-        sd_bus* bus = nullptr;
-        int ret = sd_bus_open_system(&bus);
+        int ret = sd_bus_open_system(&suspend_bus);
         if (ret < 0) {
             OUT("Failed to connect to system bus: " << strerror(-ret));
+            suspend_bus = nullptr;
             return;
         }
 
         ret = sd_bus_add_match(
-            bus, nullptr, "type='signal',interface='org.freedesktop.login1.Manager',member='PrepareForSleep'",
+            suspend_bus, nullptr, "type='signal',interface='org.freedesktop.login1.Manager',member='PrepareForSleep'",
             [](sd_bus_message* m, void* /*userdata*/, sd_bus_error* /*ret_error*/) -> int {
                 int suspend_state;
                 sd_bus_message_read(m, "b", &suspend_state);
@@ -158,22 +239,162 @@ namespace G13 {
 
         if (ret < 0) {
             OUT("Failed to add match: " << strerror(-ret));
-            sd_bus_unref(bus);
+            StopMonitorSuspendResume();
             return;
         }
 
-        while (true) {
-            ret = sd_bus_process(bus, nullptr);
-            if (ret > 0) continue; // Process pending messages
+        event_loop->Watch(sd_bus_get_fd(suspend_bus), EPOLLIN, [](uint32_t) {
+            ProcessSuspendBus();
+        });
 
-            ret = sd_bus_wait(bus, static_cast<uint64_t>(-1));
-            if (ret < 0) {
-                OUT("Failed to wait on bus: " << strerror(-ret));
-                break;
+        // Signals which arrived while sd_bus_add_match() waited for its reply are already buffered and would
+        // not make the fd readable again
+        ProcessSuspendBus();
+    }
+
+    // Process all pending messages. A bus which fails here is gone for good, and its fd would keep the
+    // event loop spinning, so it is dropped
+    void ProcessSuspendBus() {
+        int result;
+        while ((result = sd_bus_process(suspend_bus, nullptr)) > 0) {}
+        if (result < 0) {
+            ERR("Failed to process bus, no longer monitoring suspend/resume: " << strerror(-result));
+            StopMonitorSuspendResume();
+        }
+    }
+
+    void StopMonitorSuspendResume() {
+        if (suspend_bus) {
+            event_loop->Unwatch(sd_bus_get_fd(suspend_bus));
+            sd_bus_unref(suspend_bus);
+            suspend_bus = nullptr;
+        }
+    }
+
+
+    // ************************************************************************* //
+    // ***************************** Config Monitor **************************** //
+    // ************************************************************************* //
+
+    // Editors tend to write a file in several steps, so changes are collected for a moment before reloading
+    constexpr long CONFIG_RELOAD_DELAY_NS = 200 * 1000 * 1000;
+
+    int config_inotify_fid = -1;
+    int config_timer_fid = -1;
+    // Watched directory for every inotify watch descriptor
+    std::map<int, std::filesystem::path> config_watches;
+    std::set<std::filesystem::path> config_sources;
+
+    // Watches the directories of the config file and everything it loads. Watching the files themselves
+    // would miss editors which save by renaming a new file over the old one
+    void WatchConfigSources() {
+        for (const int watch : config_watches | std::views::keys) {
+            inotify_rm_watch(config_inotify_fid, watch);
+        }
+        config_watches.clear();
+        config_sources.clear();
+
+        for (const auto& source : config_program->getSources()) {
+            const auto path = std::filesystem::absolute(source).lexically_normal();
+            config_sources.insert(path);
+
+            const int watch = inotify_add_watch(config_inotify_fid, path.parent_path().c_str(),
+                                                IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE);
+            if (watch < 0) {
+                ERR("Unable to watch " << path.parent_path() << ": " << strerror(errno));
+                continue;
+            }
+            config_watches[watch] = path.parent_path();
+        }
+    }
+
+    // Recompiles the config and hands every device only the commands for what changed. Each device runs them
+    // on its own thread, between two reports, and keeps its active profile
+    void ReloadConfig() {
+        auto program = std::make_unique<ConfigSnapshot>();
+        if (!program->Load(getStringConfigValue("config"))) {
+            ERR("Keeping the current configuration");
+            return;
+        }
+
+        const auto changes = std::make_shared<const std::vector<std::string>>(
+            ConfigSnapshot::Diff(*config_program, *program));
+        config_program = std::move(program);
+        WatchConfigSources();
+
+        OUT("Configuration changed, " << changes->size() << " commands to apply");
+        if (changes->empty()) {
+            return;
+        }
+
+        std::lock_guard lock(g13s_mutex);
+        for (const auto g13 : g13s) {
+            // Devices which are not set up yet get the whole new program anyway
+            if (std::ranges::find(new_g13s, g13) == new_g13s.end()) {
+                g13->Post([g13, changes] {
+                    g13->ApplyConfigChanges(*changes);
+                });
             }
         }
+    }
+
+    // Reloads the --config file whenever it, or a file it loads, changes
+    void MonitorConfig() {
+        if (getStringConfigValue("config").empty()) {
+            return;
+        }
 
-        sd_bus_unref(bus);
+        config_inotify_fid = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        config_timer_fid = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (config_inotify_fid < 0 || config_timer_fid < 0) {
+            ERR("Unable to watch the configuration: " << strerror(errno));
+            StopMonitorConfig();
+            return;
+        }
+        WatchConfigSources();
+
+        event_loop->Watch(config_inotify_fid, EPOLLIN, [](uint32_t) {
+            alignas(inotify_event) char buffer[4096];
+            ssize_t length;
+            bool changed = false;
+            while ((length = read(config_inotify_fid, buffer, sizeof(buffer))) > 0) {
+                for (ssize_t offset = 0; offset < length;) {
+                    const auto event = reinterpret_cast<const inotify_event*>(buffer + offset);
+                    offset += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+
+                    if (const auto watch = config_watches.find(event->wd); watch != config_watches.end() && event->len) {
+                        changed |= config_sources.contains(watch->second / event->name);
+                    }
+                }
+            }
+
+            if (changed) {
+                constexpr itimerspec delay = {{0, 0}, {0, CONFIG_RELOAD_DELAY_NS}};
+                timerfd_settime(config_timer_fid, 0, &delay, nullptr);
+            }
+        });
+
+        event_loop->Watch(config_timer_fid, EPOLLIN, [](uint32_t) {
+            uint64_t expirations;
+            if (read(config_timer_fid, &expirations, sizeof(expirations)) > 0) {
+                ReloadConfig();
+            }
+        });
+    }
+
+    void StopMonitorConfig() {
+        if (config_inotify_fid >= 0) {
+            event_loop->Unwatch(config_inotify_fid);
+            close(config_inotify_fid);
+            config_inotify_fid = -1;
+        }
+        if (config_timer_fid >= 0) {
+            event_loop->Unwatch(config_timer_fid);
+            close(config_timer_fid);
+            config_timer_fid = -1;
+        }
+        config_watches.clear();
+        config_sources.clear();
     }
 
 
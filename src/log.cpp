@@ -7,6 +7,7 @@
 namespace G13 {
     log4cpp::Appender *appender1;
     bool logging_initialized = false;
+    std::recursive_mutex log_mutex;
 
     void start_logging() {
         if (logging_initialized) {
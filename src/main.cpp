@@ -5,9 +5,12 @@
 #include <csignal>
 #include <getopt.h>
 #include <iomanip>
-#include <thread>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
 
 #include "lifecycle.hpp"
+#include "Objects/ConfigSnapshot.hpp"
 #include "Objects/Key.hpp"
 #include "log.hpp"
 #include "main.hpp"
@@ -24,13 +27,20 @@ int main(const int argc, char* argv[]) {
 namespace G13 {
     // definitions
     libusb_context* usb_context = nullptr;
+    // g13s is only modified on the main thread, and always under g13s_mutex
     std::vector<Device*> g13s = {};
+    std::recursive_mutex g13s_mutex;
     libusb_hotplug_callback_handle usb_hotplug_cb_handle[3] = {};
     libusb_device** devs = nullptr;
     std::string logoFilename;
     const int class_id = LIBUSB_HOTPLUG_MATCH_ANY;
+    EventLoop* event_loop = nullptr;
 
     bool running;
+    int signal_fid = -1;
+
+    std::map<std::string, std::string> stringConfigValues;
+    std::mutex config_mutex;
 
     void Initialize(const int argc, char* argv[]) {
         InitKeynames();
@@ -48,13 +58,18 @@ namespace G13 {
                 {"pipe_dir", required_argument, nullptr, 'p'},
                 {"umask", required_argument, nullptr, 'u'},
                 {"log_level", required_argument, nullptr, 'd'},
+                {"threaded", no_argument, nullptr, 't'},
+                {"lcd_fps", required_argument, nullptr, 'r'},
+                {"legacy_images", no_argument, nullptr, 'i'},
+                {"compile", required_argument, nullptr, 'o'},
+                {"state_dir", required_argument, nullptr, 's'},
                 // {"log_file", required_argument, nullptr, 'f'},
                 {"help", no_argument, nullptr, 'h'},
                 {nullptr, no_argument, nullptr, 0}
             };
 
         while (true) {
-            const auto short_opts = "l:c:p:u:d:h";
+            const auto short_opts = "l:c:p:u:d:tr:io:s:h";
             const auto opt = getopt_long(argc, argv, short_opts, long_opts, nullptr);
 
             if (-1 == opt) {
@@ -84,6 +99,26 @@ namespace G13 {
                 SetLogLevel(getStringConfigValue("log_level"));
                 break;
 
+            case 't':
+                setStringConfigValue("threaded", "1");
+                break;
+
+            case 'r':
+                setStringConfigValue("lcd_fps", std::string(optarg));
+                break;
+
+            case 'i':
+                setStringConfigValue("legacy_images", "1");
+                break;
+
+            case 'o':
+                setStringConfigValue("compile", std::string(optarg));
+                break;
+
+            case 's':
+                setStringConfigValue("state_dir", std::string(optarg));
+                break;
+
             case 'h': // -h or --help
             case '?': // Unrecognized option
             default:
@@ -96,6 +131,9 @@ namespace G13 {
     void Cleanup() {
         OUT("Cleaning up");
 
+        StopMonitorSuspendResume();
+        StopMonitorConfig();
+
         // Deregister hotplug callbacks
         for (const auto this_handle : usb_hotplug_cb_handle) {
             if (this_handle) {
@@ -105,6 +143,7 @@ namespace G13 {
 
         // Cleanup G13 devices
         CleanupDevices();
+        ReapRetiredDevices(true);
 
         // Free device list if allocated
         if (devs) {
@@ -114,10 +153,19 @@ namespace G13 {
 
         // Exit libusb context
         if (usb_context) {
+            libusb_set_pollfd_notifiers(usb_context, nullptr, nullptr, nullptr);
             libusb_exit(usb_context);
             usb_context = nullptr;
         }
 
+        // Close the event loop
+        if (signal_fid >= 0) {
+            close(signal_fid);
+            signal_fid = -1;
+        }
+        delete event_loop;
+        event_loop = nullptr;
+
         // Stop logging
         stop_logging();
     }
@@ -134,16 +182,36 @@ namespace G13 {
         std::cout << std::left << std::setw(indent) << "  --umask <octal>" << "specify umask for pipes creation" <<
             std::endl;
         std::cout << std::left << std::setw(indent) << "  --log_level <level>" << "logging level" << std::endl;
+        std::cout << std::left << std::setw(indent) << "  --threaded" << "run each device on its own thread" <<
+            std::endl;
+        std::cout << std::left << std::setw(indent) << "  --lcd_fps <n>" << "maximum LCD frame rate (default 30)" <<
+            std::endl;
+        std::cout << std::left << std::setw(indent) << "  --legacy_images" << "take 960 byte pipe writes for LCD images" <<
+            std::endl;
+        std::cout << std::left << std::setw(indent) << "  --compile <file>" << "compile --config into a snapshot and exit" <<
+            std::endl;
+        std::cout << std::left << std::setw(indent) << "  --state_dir <dir>" << "where stick calibrations are kept" <<
+            std::endl;
         exit(1);
     }
 
     void SignalHandler(const int signal) {
         OUT("Caught signal " << signal << " (" << strsignal(signal) << ")");
         running = false;
-        // TODO: Should we break libusb handling with a reset?
+    }
+
+    // Whether every device gets its own input/action thread (--threaded)
+    bool isThreaded() {
+        return !getStringConfigValue("threaded").empty();
+    }
+
+    // Whether a bare 960 byte write to the input pipe is an LCD image (--legacy_images)
+    bool isLegacyImages() {
+        return !getStringConfigValue("legacy_images").empty();
     }
 
     std::string getStringConfigValue(const std::string& name) {
+        std::lock_guard lock(config_mutex);
         try {
             return find_or_throw(stringConfigValues, name);
         }
@@ -154,6 +222,7 @@ namespace G13 {
 
     void setStringConfigValue(const std::string& name, const std::string& value) {
         DBG("setStringConfigValue " << name << " = " << formatter(value));
+        std::lock_guard lock(config_mutex);
         stringConfigValues[name] = value;
     }
 
@@ -166,11 +235,93 @@ namespace G13 {
     // ****************************** Main Loop ******************************** //
     // ************************************************************************* //
 
+    // Handles whatever libusb has pending without blocking; transfer and hotplug callbacks run from here
+    void HandleUsbEvents(uint32_t /*events*/) {
+        timeval tv = {0, 0};
+        if (const int error = libusb_handle_events_timeout_completed(usb_context, &tv, nullptr);
+            error != LIBUSB_SUCCESS && error != LIBUSB_ERROR_INTERRUPTED) {
+            ERR("Error while handling USB events: " << Device::DescribeLibusbErrorCode(error));
+        }
+    }
+
+    void LIBUSB_CALL UsbPollfdAdded(const int fd, const short events, void* /*user_data*/) {
+        event_loop->Watch(fd, static_cast<uint32_t>(events), HandleUsbEvents);
+    }
+
+    void LIBUSB_CALL UsbPollfdRemoved(const int fd, void* /*user_data*/) {
+        event_loop->Unwatch(fd);
+    }
+
+    void WatchUsbPollfds() {
+        if (const auto pollfds = libusb_get_pollfds(usb_context)) {
+            for (auto pollfd = pollfds; *pollfd; pollfd++) {
+                UsbPollfdAdded((*pollfd)->fd, (*pollfd)->events, nullptr);
+            }
+            libusb_free_pollfds(pollfds);
+        }
+        libusb_set_pollfd_notifiers(usb_context, UsbPollfdAdded, UsbPollfdRemoved, nullptr);
+    }
+
+    // Time in ms until libusb needs to handle a timeout, or -1 if it tracks its timeouts through its own fds
+    int NextUsbTimeout() {
+        if (libusb_pollfds_handle_timeouts(usb_context)) {
+            return -1;
+        }
+
+        timeval tv{};
+        if (libusb_get_next_timeout(usb_context, &tv) != 1) {
+            return -1;
+        }
+        return static_cast<int>(tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000);
+    }
+
+    // SIGINT and SIGTERM are delivered through a signalfd so they wake the event loop like any other event
+    int WatchSignals() {
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGINT);
+        sigaddset(&mask, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+
+        signal_fid = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (signal_fid < 0) {
+            ERR("Unable to create signalfd: " << strerror(errno));
+            return 1;
+        }
+
+        event_loop->Watch(signal_fid, EPOLLIN, [](uint32_t) {
+            signalfd_siginfo info{};
+            while (read(signal_fid, &info, sizeof(info)) == sizeof(info)) {
+                SignalHandler(static_cast<int>(info.ssi_signo));
+            }
+        });
+        return 0;
+    }
+
+    // --compile: turns the --config file into a snapshot instead of running the daemon
+    int CompileConfig() {
+        const std::string config_filename = getStringConfigValue("config");
+        if (config_filename.empty()) {
+            ERR("--compile needs a --config file to compile");
+            return EXIT_FAILURE;
+        }
+        const bool success = ConfigSnapshot::Compile(config_filename, getStringConfigValue("compile"));
+        stop_logging();
+        return success ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
     int Run() {
+        if (!getStringConfigValue("compile").empty()) {
+            return CompileConfig();
+        }
+
         running = true;
 
         DisplayKeys();
 
+        event_loop = new EventLoop();
+        WatchSignals();
+
         int error = libusb_init(&usb_context);
         if (error != LIBUSB_SUCCESS) {
             ERR("libusb initialization error: " << Device::DescribeLibusbErrorCode(error));
@@ -178,6 +329,8 @@ namespace G13 {
             return EXIT_FAILURE;
         }
         libusb_set_option(usb_context, LIBUSB_OPTION_LOG_LEVEL, 3);
+        WatchUsbPollfds();
+        LoadConfig();
 
         if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
             int ret = InitializeDevices();
@@ -192,44 +345,28 @@ namespace G13 {
             ArmHotplugCallbacks();
         }
 
-        signal(SIGINT, SignalHandler);
-        signal(SIGTERM, SignalHandler);
+        SetupNewDevices();
 
-        for (const auto g13 : g13s) {
-            SetupDevice(g13);
-        }
-
-        std::thread suspend_thread(MonitorSuspendResume);
-        suspend_thread.detach(); // Run the suspend monitoring in the background
+        MonitorSuspendResume();
+        MonitorConfig();
 
+        bool waiting = false;
         while (running) {
-            if (g13s.empty()) {
+            if (g13s.empty() && !waiting) {
                 OUT("Waiting for device to show up...");
-                error = libusb_handle_events(usb_context);
-                OUT("USB Event wakeup with " << g13s.size() << " devices registered");
-
-                if (error != LIBUSB_SUCCESS) {
-                    ERR("Error: " << Device::DescribeLibusbErrorCode(error));
-                }
-                else {
-                    for (const auto g13 : g13s) {
-                        SetupDevice(g13);
-                    }
-                }
+                waiting = true;
             }
 
-            // Main loop
-            if (!suspended) {
-                for (const auto g13 : g13s) {
-                    const int status = g13->ReadDeviceInputs();
-                    if (!g13s.empty()) {
-                        g13->ReadCommandsFromPipe();
-                    }
-                    if (status < 0) {
-                        running = false;
-                    }
-                }
+            // Main loop: sleeps until USB, a pipe, sd-bus or a signal has work for us
+            event_loop->RunOnce(NextUsbTimeout());
+
+            if (waiting && !g13s.empty()) {
+                OUT("USB Event wakeup with " << g13s.size() << " devices registered");
+                waiting = false;
             }
+            SetupNewDevices();
+
+            ReapRetiredDevices();
         }
 
         Cleanup();